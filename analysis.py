@@ -1,4 +1,4 @@
-from symnmf import proccess_input_file, init_H
+from symnmf import proccess_input_file, read_matrix_file, init_H
 import symnmf_module
 from sklearn.metrics import silhouette_score
 import numpy as np
@@ -110,8 +110,9 @@ def labels_from_symnmf(results):
 	"""
 	labels = []
 
-	for row in results:
-		labels.append(row.index(max(row)))
+	# The cluster of a point is the column of its largest value, the first one on ties
+	for row in np.asarray(results):
+		labels.append(int(np.argmax(row)))
 
 	return labels
 
@@ -144,6 +145,8 @@ def main():
 
 	# Get matrix from input file
 	X = proccess_input_file(file_name)
+	# The C module maps a matrix file itself, kmeans needs its points
+	points = read_matrix_file(X) if isinstance(X, str) else X
 
 	# Perform both algorithms
 	try:
@@ -151,15 +154,15 @@ def main():
 	except RuntimeError as e:
 		print(e)
 		sys.exit(1)
-	kmeans_results = kmeans(k, X)
+	kmeans_results = kmeans(k, points)
 
 	# Get labels from algorithm results
 	symnmf_labels = labels_from_symnmf(symnmf_results)
-	kmeans_labels = labels_from_kmeans(X, kmeans_results)
+	kmeans_labels = labels_from_kmeans(points, kmeans_results)
 
 	# Calculate silhouette scores for both algorithms
-	symnmf_score = silhouette_score(X, symnmf_labels)
-	kmeans_score = silhouette_score(X, kmeans_labels)
+	symnmf_score = silhouette_score(points, symnmf_labels)
+	kmeans_score = silhouette_score(points, kmeans_labels)
 
 	# Print scores
 	print(f"nmf: {symnmf_score:.4f}")
@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+#include "matrix.h"
+#include "gemm.h"
+#include "simd.h"
+
+
+static double now(void) {
+    /* Wall clock time in seconds */
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static void fill_random(matrix* A) {
+    /* Fill a matrix with values in [0, 1) */
+    int i, j;
+
+    for (i = 0; i < A->rows; i++) {
+        for (j = 0; j < A->cols; j++) {
+            MATRIX_AT(A, i, j) = rand() / (RAND_MAX + 1.0);
+        }
+    }
+}
+
+
+static void naive_multiplication(const matrix* A, const matrix* B, matrix* C) {
+    /* The i-j-k triple loop matrix_multiplication used before the blocked kernel, kept as the baseline */
+    int i, j, k;
+
+    for (i = 0; i < A->rows; i++) {
+        for (j = 0; j < B->cols; j++) {
+            MATRIX_AT(C, i, j) = 0;
+
+            for (k = 0; k < A->cols; k++) {
+                MATRIX_AT(C, i, j) += MATRIX_AT(A, i, k) * MATRIX_AT(B, k, j);
+            }
+        }
+    }
+}
+
+
+static double max_difference(const matrix* A, const matrix* B) {
+    /* Largest absolute difference between two matrices of the same size */
+    double result, diff;
+    int i, j;
+
+    result = 0;
+    for (i = 0; i < A->rows; i++) {
+        for (j = 0; j < A->cols; j++) {
+            diff = MATRIX_AT(A, i, j) - MATRIX_AT(B, i, j);
+            diff = diff < 0 ? -diff : diff;
+            result = diff > result ? diff : result;
+        }
+    }
+
+    return result;
+}
+
+
+static void bench_gemm(int n, int r, int m) {
+    /* Time the naive and blocked products of an n x r and an r x m matrix and print their GFLOP/s */
+    matrix* A;
+    matrix* B;
+    matrix* C_naive;
+    matrix* C_blocked;
+    double flops, start, naive_time, blocked_time;
+    int reps, rep;
+
+    A = malloc_matrix(n, r);
+    B = malloc_matrix(r, m);
+    C_naive = malloc_matrix(n, m);
+    C_blocked = malloc_matrix(n, m);
+    fill_random(A);
+    fill_random(B);
+
+    /* Repeat small products so every measurement takes a noticeable time */
+    flops = 2.0 * n * r * m;
+    reps = (int)(2e9 / flops) + 1;
+
+    start = now();
+    for (rep = 0; rep < reps; rep++) {
+        naive_multiplication(A, B, C_naive);
+    }
+    naive_time = (now() - start) / reps;
+
+    start = now();
+    for (rep = 0; rep < reps; rep++) {
+        gemm(A, B, C_blocked);
+    }
+    blocked_time = (now() - start) / reps;
+
+    printf("gemm %5d x %5d x %5d  naive %7.2f GFLOP/s  blocked %7.2f GFLOP/s  speedup %5.2fx  max diff %.1e\n",
+           n, r, m, flops / naive_time * 1e-9, flops / blocked_time * 1e-9, naive_time / blocked_time,
+           max_difference(C_naive, C_blocked));
+
+    free_matrix(A);
+    free_matrix(B);
+    free_matrix(C_naive);
+    free_matrix(C_blocked);
+}
+
+
+static void bench_simd(const char* name, int n, int d) {
+    /* Time the distance and exp kernels of one instruction set over all pairs of n points of dimension d,
+    and compare them with the scalar distance loop and libm exp */
+    const simd_kernels* kernels;
+    matrix* X;
+    matrix* XT;
+    double* out;
+    double* v;
+    double* expected;
+    double start, distance_time, exp_time, error, max_error;
+    int i, j;
+
+    kernels = simd_find(name);
+    if (kernels == NULL) {
+        printf("simd %-6s not supported by this CPU\n", name);
+        return;
+    }
+
+    X = malloc_matrix(n, d);
+    fill_random(X);
+    XT = transpose(X);
+    out = (double*)malloc(n * sizeof(double));
+    v = (double*)malloc(n * sizeof(double));
+    expected = (double*)malloc(n * sizeof(double));
+
+    start = now();
+    for (i = 0; i < n; i++) {
+        kernels->squared_distances(MATRIX_ROW(X, i), MATRIX_ROW(XT, 0), XT->stride, d, n, out);
+    }
+    distance_time = now() - start;
+
+    /* Exponents spread over the range where exp(-v / 2) is still above the 1e-4 output precision and past it */
+    exp_time = 0;
+    max_error = 0;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            v[j] = 60.0 * (i * n + j) / ((double)n * n);
+            expected[j] = exp(-v[j] / 2);
+        }
+
+        start = now();
+        kernels->exp_neg_half(v, n);
+        exp_time += now() - start;
+
+        for (j = 0; j < n; j++) {
+            error = fabs(v[j] - expected[j]) / expected[j];
+            max_error = error > max_error ? error : max_error;
+        }
+    }
+
+    printf("simd %-6s distance (d=%d) %7.1f Mpairs/s  exp %7.1f Mvalues/s  exp max relative error %.1e\n",
+           name, d, (double)n * n / distance_time * 1e-6, (double)n * n / exp_time * 1e-6, max_error);
+
+    free(out);
+    free(v);
+    free(expected);
+    free_matrix(X);
+    free_matrix(XT);
+}
+
+
+int main(void) {
+    int sizes[] = {1000, 2000, 4000};
+    int ks[] = {2, 5, 10, 20};
+    const char* isas[] = {"scalar", "sse2", "avx2", "avx512"};
+    unsigned int i, j;
+
+    srand(1234);
+
+    /* The distance and exp kernels of the similarity matrix */
+    for (i = 0; i < sizeof(isas) / sizeof(isas[0]); i++) {
+        bench_simd(isas[i], 4000, 5);
+    }
+
+    /* The W * H shapes of symnmf_c_step, n x n times n x k */
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (j = 0; j < sizeof(ks) / sizeof(ks[0]); j++) {
+            bench_gemm(sizes[i], sizes[i], ks[j]);
+        }
+    }
+
+    /* H^t * H and a square product for reference */
+    bench_gemm(10, 4000, 10);
+    bench_gemm(1000, 1000, 1000);
+
+    return 0;
+}
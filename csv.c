@@ -0,0 +1,642 @@
+/* madvise for the mapped file */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "csv.h"
+#include "simd.h"
+#include "parallel.h"
+
+
+/* Powers of 10 that are exact doubles, the fast parser only uses these */
+static const double exact_powers[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+    1e19, 1e20, 1e21, 1e22
+};
+/* Significant digits summed exactly in a double, any integer of this many digits is below 2^53 */
+#define EXACT_DIGITS 15
+
+
+/* The whole input in memory, mapped from a regular file or read from a pipe */
+typedef struct {
+    char* text;
+    size_t length;
+    int mapped;
+} csv_text;
+
+
+static void fail(const char* path, int line, const char* problem, int expected, int found) {
+    /* Report a bad input, with the line it is on when there is one, and exit */
+
+    printf("An Error Has Occurred\n");
+    if (line > 0 && expected > 0) {
+        fprintf(stderr, "%s:%d: expected %d values, found %d\n", path, line, expected, found);
+    }
+    else if (line > 0) {
+        fprintf(stderr, "%s:%d: %s\n", path, line, problem);
+    }
+    else {
+        fprintf(stderr, "%s: %s\n", path, problem);
+    }
+    exit(1);
+}
+
+
+static void load_text(const char* path, csv_text* input) {
+    /* Map a regular file, anything else ("-" for stdin, a pipe, a terminal) is read block by block */
+
+    struct stat status;
+    char* grown;
+    size_t capacity;
+    ssize_t got;
+    int file;
+
+    file = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (file < 0) {
+        fail(path, 0, "can't open", 0, 0);
+    }
+
+    input->text = NULL;
+    input->length = 0;
+    input->mapped = 0;
+
+    if (fstat(file, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+        input->text = (char*)mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (input->text != MAP_FAILED) {
+            input->length = (size_t)status.st_size;
+            input->mapped = 1;
+            madvise(input->text, input->length, MADV_SEQUENTIAL);
+        }
+        else {
+            input->text = NULL;
+        }
+    }
+
+    /* Read until the end, doubling the buffer when it is full */
+    capacity = 0;
+    while (!input->mapped) {
+        if (input->length == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : CSV_READ_BLOCK;
+            grown = (char*)realloc(input->text, capacity);
+            if (grown == NULL) {
+                printf("An Error Has Occurred\n");
+                exit(1);
+            }
+            input->text = grown;
+        }
+
+        got = read(file, input->text + input->length, capacity - input->length);
+        if (got < 0) {
+            fail(path, 0, "can't read", 0, 0);
+        }
+        if (got == 0) {
+            break;
+        }
+        input->length += (size_t)got;
+    }
+
+    if (file != STDIN_FILENO) {
+        close(file);
+    }
+}
+
+
+static size_t* find_line_ends(const csv_text* input, size_t* count) {
+    /* Offsets of the ends of all lines in a single vector scan for '\n', an unterminated last line ends at
+    the end of the text */
+
+    const simd_kernels* kernels;
+    size_t* ends;
+    size_t* grown;
+    size_t capacity, start, found;
+
+    kernels = simd_select();
+    capacity = 1024;
+    ends = (size_t*)malloc(capacity * sizeof(size_t));
+    if (ends == NULL) {
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+
+    *count = 0;
+    start = 0;
+    for (;;) {
+        found = kernels->newlines(input->text, start, input->length, ends + *count, capacity - *count);
+        *count += found;
+
+        /* Room was left, so the scan reached the end */
+        if (*count < capacity) {
+            break;
+        }
+
+        start = ends[*count - 1] + 1;
+        capacity *= 2;
+        grown = (size_t*)realloc(ends, capacity * sizeof(size_t));
+        if (grown == NULL) {
+            printf("An Error Has Occurred\n");
+            exit(1);
+        }
+        ends = grown;
+    }
+
+    if (input->length > 0 && (*count == 0 || ends[*count - 1] != input->length - 1)) {
+        ends[(*count)++] = input->length;
+    }
+
+    return ends;
+}
+
+
+static int is_blank(char c) {
+    /* Whether c can surround a value, '\r' is the end of a Windows line */
+
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static const char* slow_value(const char* p, const char* end, double* value) {
+    /* Parse a value with strtod, for the ones the fast parser can't round exactly (and inf, nan or hex) */
+
+    char token[CSV_MAX_VALUE + 1];
+    char* stop;
+    size_t length;
+
+    length = 0;
+    while (p + length < end && p[length] != ',' && !is_blank(p[length])) {
+        length++;
+    }
+    if (length == 0 || length > CSV_MAX_VALUE) {
+        return NULL;
+    }
+
+    memcpy(token, p, length);
+    token[length] = '\0';
+    *value = strtod(token, &stop);
+
+    return stop == token + length ? p + length : NULL;
+}
+
+
+static const char* parse_value(const char* p, const char* end, double* value) {
+    /* Parse the decimal value at p and return where it ends, NULL if it isn't one. Up to EXACT_DIGITS
+    significant digits and a power of 10 up to 22 away the value is an exact integer times or divided by an exact
+    power of 10, a single correctly rounded operation, so the result is the one strtod (and fscanf) gives;
+    everything else goes to strtod. No locale is involved, the decimal point is always '.' */
+
+    const char* start;
+    double mantissa;
+    int negative, digits, any_digit, truncated;
+    int exponent, written_exponent, exponent_negative;
+    double result;
+
+    start = p;
+    negative = 0;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    mantissa = 0;
+    digits = 0;
+    any_digit = 0;
+    truncated = 0;
+    exponent = 0;
+
+    /* Integer part, leading zeros aren't significant */
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        any_digit = 1;
+        if (digits < EXACT_DIGITS && (mantissa > 0 || *p != '0')) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+        }
+        else if (digits >= EXACT_DIGITS) {
+            exponent++;
+            truncated |= *p != '0';
+        }
+    }
+
+    /* Fraction */
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            any_digit = 1;
+            if (digits < EXACT_DIGITS && (mantissa > 0 || *p != '0')) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits++;
+                exponent--;
+            }
+            else if (digits < EXACT_DIGITS) {
+                exponent--;
+            }
+            else {
+                truncated |= *p != '0';
+            }
+        }
+    }
+
+    if (!any_digit) {
+        return slow_value(start, end, value);
+    }
+
+    /* Exponent, large ones are left to strtod */
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        exponent_negative = 0;
+        if (p < end && (*p == '+' || *p == '-')) {
+            exponent_negative = *p == '-';
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            return slow_value(start, end, value);
+        }
+
+        written_exponent = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (written_exponent < 10000) {
+                written_exponent = written_exponent * 10 + (*p - '0');
+            }
+        }
+        exponent += exponent_negative ? -written_exponent : written_exponent;
+    }
+
+    /* The value has to end here */
+    if (p < end && *p != ',' && !is_blank(*p)) {
+        return slow_value(start, end, value);
+    }
+
+    if (mantissa == 0 && !truncated) {
+        *value = negative ? -0.0 : 0.0;
+        return p;
+    }
+    if (truncated || exponent < -22 || exponent > 22) {
+        return slow_value(start, end, value);
+    }
+
+    result = exponent < 0 ? mantissa / exact_powers[-exponent] : mantissa * exact_powers[exponent];
+    *value = negative ? -result : result;
+
+    return p;
+}
+
+
+static int parse_row(const char* p, const char* end, int d, double* row) {
+    /* Parse a line of comma separated values into row, which has room for d of them. Returns how many values
+    the line holds, or -1 if it isn't a list of values */
+
+    double value;
+    int count;
+
+    count = 0;
+    for (;;) {
+        while (p < end && is_blank(*p)) {
+            p++;
+        }
+
+        if ((p = parse_value(p, end, &value)) == NULL) {
+            return -1;
+        }
+        if (count < d) {
+            row[count] = value;
+        }
+        count++;
+
+        while (p < end && is_blank(*p)) {
+            p++;
+        }
+
+        if (p == end) {
+            return count;
+        }
+        if (*p != ',') {
+            return -1;
+        }
+        p++;
+    }
+}
+
+
+matrix* read_csv(const char* path) {
+    /* Read a matrix of comma separated values, a point per line. The input is read once: a vector scan finds
+    the lines, then the threads parse blocks of them into their rows. Reading stops at the first empty line, and
+    every line before it must hold as many values as the first one. A bad input ends the program with the line
+    it is on, this is the reader of the command line tool */
+
+    csv_text input;
+    matrix* A;
+    size_t* ends;
+    size_t lines, start;
+    int n, d, i;
+    int bad_line, bad_count, count;
+
+    load_text(path, &input);
+    ends = find_line_ends(&input, &lines);
+
+    /* Points end at the first empty line */
+    for (n = 0; (size_t)n < lines; n++) {
+        start = n == 0 ? 0 : ends[n - 1] + 1;
+        if (ends[n] == start || (ends[n] == start + 1 && input.text[start] == '\r')) {
+            break;
+        }
+        if (n == 0x7fffffff) {
+            fail(path, 0, "too many lines", 0, 0);
+        }
+    }
+    if (n == 0) {
+        fail(path, 0, "no values", 0, 0);
+    }
+
+    /* The first line sets the dimension */
+    d = 1;
+    for (start = 0; start < ends[0]; start++) {
+        d += input.text[start] == ',';
+    }
+
+    A = malloc_matrix(n, d);
+    if (A == NULL) {
+        fail(path, 0, "out of memory", 0, 0);
+    }
+
+    /* Every thread parses a contiguous block of lines, the first bad one is reported */
+    bad_line = 0;
+    bad_count = 0;
+    #pragma omp parallel for private(count) schedule(static) if ((double)input.length > PARALLEL_MIN_WORK)
+    for (i = 0; i < n; i++) {
+        count = parse_row(input.text + (i == 0 ? 0 : ends[i - 1] + 1), input.text + ends[i], d, MATRIX_ROW(A, i));
+
+        if (count != d) {
+            #pragma omp critical
+            {
+                if (bad_line == 0 || i + 1 < bad_line) {
+                    bad_line = i + 1;
+                    bad_count = count;
+                }
+            }
+        }
+    }
+
+    if (input.mapped) {
+        munmap(input.text, input.length);
+    }
+    else {
+        free(input.text);
+    }
+    free(ends);
+
+    if (bad_line > 0) {
+        free_matrix(A);
+        fail(path, bad_line, "not a list of values", bad_count < 0 ? 0 : d, bad_count);
+    }
+
+    return A;
+}
+
+
+/* Text of a block of formatted rows, grown as needed */
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    int failed; /* it couldn't grow, whatever it holds is incomplete */
+} text_buffer;
+
+
+static int reserve(text_buffer* buffer, size_t more) {
+    /* Make room for more bytes at the end of a buffer. Returns 0, or -1 if there isn't enough memory, which
+    marks the buffer as failed */
+
+    char* grown;
+    size_t capacity;
+
+    if (buffer->length + more <= buffer->capacity) {
+        return 0;
+    }
+
+    capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->length + more) {
+        capacity *= 2;
+    }
+
+    grown = (char*)realloc(buffer->data, capacity);
+    if (grown == NULL) {
+        buffer->failed = 1;
+        return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+
+    return 0;
+}
+
+
+static size_t format_cell(double value, char* out) {
+    /* Write value the way printf("%.4f") does and return the number of bytes. Below 200000 the value times
+    10^4 is rounded to an integer and printed with its last 4 digits as decimals; the product is within half an
+    ulp, so the rounding is the exact one unless the product lies that close to a half, which is left to
+    sprintf with everything else */
+
+    static const double scale = 10000;
+    char digits[16];
+    double magnitude, scaled, whole, fraction;
+    unsigned long units;
+    size_t length;
+    int count, i;
+
+    magnitude = value < 0 ? -value : value;
+    if (!(magnitude < 200000)) { /* large, inf and nan */
+        return (size_t)sprintf(out, "%.4f", value);
+    }
+
+    scaled = magnitude * scale;
+    whole = floor(scaled);
+    fraction = scaled - whole;
+    if (fabs(fraction - 0.5) <= scaled * 2.3e-16) {
+        return (size_t)sprintf(out, "%.4f", value);
+    }
+    units = (unsigned long)whole + (fraction > 0.5);
+
+    /* The sign of -0.0 (and of negatives rounding to 0) is kept, as printf does */
+    length = 0;
+    if (value < 0 || (value == 0 && 1 / value < 0)) {
+        out[length++] = '-';
+    }
+
+    /* Digits from the last one, at least one before the point */
+    count = 0;
+    do {
+        digits[count++] = (char)('0' + units % 10);
+        units /= 10;
+    } while (units > 0 || count < 5);
+
+    for (i = count - 1; i >= 4; i--) {
+        out[length++] = digits[i];
+    }
+    out[length++] = '.';
+    for (i = 3; i >= 0; i--) {
+        out[length++] = digits[i];
+    }
+
+    return length;
+}
+
+
+static void format_rows(const matrix* A, int start, int end, text_buffer* buffer) {
+    /* Append the rows start to end - 1 of a matrix of any layout, a line of comma separated cells each. Stops
+    when the buffer can't grow */
+
+    const double* row;
+    int i, j;
+
+    for (i = start; i < end; i++) {
+        row = A->layout == MATRIX_DENSE && A->dtype == MATRIX_FLOAT64 ? MATRIX_ROW(A, i) : NULL;
+
+        for (j = 0; j < A->cols; j++) {
+            if (reserve(buffer, CSV_MAX_CELL + 1) != 0) {
+                return;
+            }
+            buffer->length += format_cell(row != NULL ? row[j] : matrix_get(A, i, j), buffer->data + buffer->length);
+            buffer->data[buffer->length++] = j < A->cols - 1 ? ',' : '\n';
+        }
+
+        /* A matrix without columns still prints its empty lines */
+        if (A->cols == 0) {
+            if (reserve(buffer, 1) != 0) {
+                return;
+            }
+            buffer->data[buffer->length++] = '\n';
+        }
+    }
+}
+
+
+static int format_batch(const matrix* A, int start, text_buffer* buffers, int threads) {
+    /* Format the next batch of rows from start on, a block of about CSV_FORMAT_CELLS cells per thread into its
+    buffer. Returns the row after the batch, or -1 if a buffer couldn't grow */
+
+    int rows, end, t;
+
+    rows = A->cols > 0 && A->cols < CSV_FORMAT_CELLS ? CSV_FORMAT_CELLS / A->cols : 1;
+    end = (double)start + (double)rows * threads < A->rows ? start + rows * threads : A->rows;
+
+    #pragma omp parallel for schedule(static, 1) num_threads(threads) if (end - start > rows)
+    for (t = 0; t < threads; t++) {
+        buffers[t].length = 0;
+        if (start + t * rows < end) {
+            format_rows(A, start + t * rows, start + (t + 1) * rows < end ? start + (t + 1) * rows : end,
+                        &buffers[t]);
+        }
+    }
+
+    for (t = 0; t < threads; t++) {
+        if (buffers[t].failed) {
+            return -1;
+        }
+    }
+
+    return end;
+}
+
+
+static text_buffer* malloc_buffers(int threads) {
+    /* An empty buffer for every thread, NULL if there isn't enough memory */
+
+    return (text_buffer*)calloc((size_t)threads, sizeof(text_buffer));
+}
+
+
+static void free_buffers(text_buffer* buffers, int threads) {
+    /* Free the buffers of all threads */
+
+    int t;
+
+    for (t = 0; t < threads; t++) {
+        free(buffers[t].data);
+    }
+    free(buffers);
+}
+
+
+char* format_matrix(const matrix* A, size_t* length) {
+    /* The text print_matrix gives for a matrix of any layout, a line of "%.4f" cells per row, in a single
+    buffer of *length bytes the caller frees. The rows are formatted in blocks over all threads. Returns NULL
+    if there isn't enough memory */
+
+    text_buffer* buffers;
+    text_buffer result;
+    int threads, row, t;
+
+    threads = parallel_threads();
+    buffers = malloc_buffers(threads);
+    result.data = NULL;
+    result.length = 0;
+    result.capacity = 0;
+    result.failed = buffers == NULL;
+    reserve(&result, 1);
+
+    row = 0;
+    while (!result.failed && row < A->rows) {
+        row = format_batch(A, row, buffers, threads);
+        result.failed = row < 0;
+
+        /* Append the blocks in row order */
+        for (t = 0; t < threads && !result.failed; t++) {
+            if (reserve(&result, buffers[t].length) == 0) {
+                memcpy(result.data + result.length, buffers[t].data, buffers[t].length);
+                result.length += buffers[t].length;
+            }
+        }
+    }
+
+    if (buffers != NULL) {
+        free_buffers(buffers, threads);
+    }
+    if (result.failed) {
+        free(result.data);
+        return NULL;
+    }
+    *length = result.length;
+
+    return result.data;
+}
+
+
+int write_matrix(const matrix* A, int file) {
+    /* Write the text of format_matrix to a file descriptor a batch at a time, so only a few blocks of it are
+    ever in memory. Returns 0, or -1 if there isn't enough memory or the write fails */
+
+    text_buffer* buffers;
+    ssize_t written;
+    size_t done;
+    int threads, row, t;
+
+    threads = parallel_threads();
+    buffers = malloc_buffers(threads);
+    if (buffers == NULL) {
+        return -1;
+    }
+
+    row = 0;
+    written = 0;
+    while (row >= 0 && written >= 0 && row < A->rows) {
+        row = format_batch(A, row, buffers, threads);
+
+        /* Write the blocks in row order, a write may take only part of one */
+        for (t = 0; t < threads && row >= 0 && written >= 0; t++) {
+            for (done = 0; done < buffers[t].length; done += (size_t)written) {
+                written = write(file, buffers[t].data + done, buffers[t].length - done);
+                if (written < 0) {
+                    break;
+                }
+            }
+        }
+    }
+
+    free_buffers(buffers, threads);
+
+    return row < 0 || written < 0 ? -1 : 0;
+}
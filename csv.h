@@ -0,0 +1,19 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include "matrix.h"
+
+/* Bytes read at a time from a pipe, the buffer grows by doubling */
+#define CSV_READ_BLOCK 65536
+/* Longest value handed to strtod when the fast parser can't give the exact result, longer ones are an error */
+#define CSV_MAX_VALUE 128
+/* Cells formatted together by a thread before the text goes out, in order */
+#define CSV_FORMAT_CELLS 65536
+/* Most a cell printed with "%.4f" can take: a sign, 309 digits of DBL_MAX, the point and 4 decimals */
+#define CSV_MAX_CELL 320
+
+matrix* read_csv(const char* path);
+char* format_matrix(const matrix* A, size_t* length);
+int write_matrix(const matrix* A, int file);
+
+#endif
@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gemm.h"
+#include "parallel.h"
+
+
+static void pack_B(const matrix* B, int pc, int kc, int jc, int nc, double* packed) {
+    /* Copy the kc x nc block of B starting at (pc, jc) into panels of GEMM_NR columns, each stored row after
+    row so the kernel reads it contiguously. Columns past the end of B are padded with 0 */
+
+    const double* B_row;
+    double* panel;
+    int jr, p, j;
+
+    for (jr = 0; jr < nc; jr += GEMM_NR) {
+        panel = packed + (size_t)jr * kc;
+
+        for (p = 0; p < kc; p++) {
+            B_row = MATRIX_ROW(B, pc + p) + jc + jr;
+
+            for (j = 0; j < GEMM_NR; j++) {
+                panel[p * GEMM_NR + j] = jr + j < nc ? B_row[j] : 0;
+            }
+        }
+    }
+}
+
+
+static void micro_kernel(int kc, const double* A, size_t lda, int mr, const double* panel,
+                         double* C, size_t ldc, int nr) {
+    /* Add the product of the mr x kc block of A (mr <= GEMM_MR) and a packed kc x GEMM_NR panel of B to the
+    mr x nr block of C, keeping the GEMM_MR x GEMM_NR results in registers for the whole kc loop */
+
+    double c[GEMM_MR][GEMM_NR];
+    const double* a[GEMM_MR];
+    const double* b;
+    int p, i, j;
+
+    memset(c, 0, sizeof(c));
+
+    if (mr == GEMM_MR) { /* full tile, every row of A read as its own stream */
+        for (i = 0; i < GEMM_MR; i++) {
+            a[i] = A + i * lda;
+        }
+
+        for (p = 0; p < kc; p++) {
+            b = panel + p * GEMM_NR;
+
+            for (i = 0; i < GEMM_MR; i++) {
+                for (j = 0; j < GEMM_NR; j++) {
+                    c[i][j] += a[i][p] * b[j];
+                }
+            }
+        }
+    }
+    else { /* last rows of A */
+        for (p = 0; p < kc; p++) {
+            b = panel + p * GEMM_NR;
+
+            for (i = 0; i < mr; i++) {
+                for (j = 0; j < GEMM_NR; j++) {
+                    c[i][j] += A[i * lda + p] * b[j];
+                }
+            }
+        }
+    }
+
+    /* Add the tile to C, leaving out the padding columns */
+    for (i = 0; i < mr; i++) {
+        for (j = 0; j < nr; j++) {
+            C[i * ldc + j] += c[i][j];
+        }
+    }
+}
+
+
+size_t gemm_workspace_size(void) {
+    /* Number of doubles gemm_workspace needs to pack a block of B */
+
+    return (size_t)GEMM_KC * (GEMM_NC + GEMM_NR);
+}
+
+
+void gemm_workspace(const matrix* A, const matrix* B, matrix* C, double* workspace) {
+    /* Calculate C = A * B for dense matrices of size n x r, r x m and n x m, packing blocks of B into
+    workspace (gemm_workspace_size() doubles).
+    A is read in place since for the tall-skinny products of symnmf (n x n times n x k) copying it would
+    double the memory traffic of the whole product */
+
+    double* packed;
+    int jc, pc, ic, jr, ir;
+    int nc, kc, mc;
+    int i;
+
+    packed = workspace;
+
+    /* C starts from 0 and every block product is added to it */
+    for (i = 0; i < C->rows; i++) {
+        memset(MATRIX_ROW(C, i), 0, C->cols * sizeof(double));
+    }
+
+    for (jc = 0; jc < B->cols; jc += GEMM_NC) {
+        nc = B->cols - jc < GEMM_NC ? B->cols - jc : GEMM_NC;
+
+        for (pc = 0; pc < A->cols; pc += GEMM_KC) {
+            kc = A->cols - pc < GEMM_KC ? A->cols - pc : GEMM_KC;
+            pack_B(B, pc, kc, jc, nc, packed);
+
+            /* Every thread takes its own blocks of rows of A and C */
+            #pragma omp parallel for private(mc, jr, ir) schedule(static) \
+                if ((double)A->rows * kc * nc > PARALLEL_MIN_WORK)
+            for (ic = 0; ic < A->rows; ic += GEMM_MC) {
+                mc = A->rows - ic < GEMM_MC ? A->rows - ic : GEMM_MC;
+
+                /* The mc x kc block of A stays in L2 while it is multiplied by every panel */
+                for (jr = 0; jr < nc; jr += GEMM_NR) {
+                    for (ir = 0; ir < mc; ir += GEMM_MR) {
+                        micro_kernel(kc, MATRIX_ROW(A, ic + ir) + pc, A->stride,
+                                     mc - ir < GEMM_MR ? mc - ir : GEMM_MR,
+                                     packed + (size_t)jr * kc,
+                                     MATRIX_ROW(C, ic + ir) + jc + jr, C->stride,
+                                     nc - jr < GEMM_NR ? nc - jr : GEMM_NR);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+static int padded_cols(const matrix* B) {
+    /* Number of columns of B rounded up to whole panels */
+
+    return (B->cols + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+}
+
+
+size_t gemm_packed_size(const matrix* B) {
+    /* Number of doubles gemm_pack needs to pack all of B */
+
+    return (size_t)B->rows * padded_cols(B);
+}
+
+
+void gemm_pack(const matrix* B, double* packed) {
+    /* Pack all of B, block by block of GEMM_KC rows, for gemm_rows. Meant for narrow B (like H), which is
+    then packed once and shared by every row block of A */
+
+    int pc, kc;
+
+    for (pc = 0; pc < B->rows; pc += GEMM_KC) {
+        kc = B->rows - pc < GEMM_KC ? B->rows - pc : GEMM_KC;
+        pack_B(B, pc, kc, 0, B->cols, packed + (size_t)pc * padded_cols(B));
+    }
+}
+
+
+void gemm_rows(const matrix* A, const matrix* B, const double* packed, int row, int rows, double* C, size_t ldc) {
+    /* Calculate rows row to row + rows - 1 of A * B into C (rows x m, ldc elements between rows), with B
+    already packed by gemm_pack. Runs on the calling thread, so every thread can fill its own tile */
+
+    const double* block;
+    int pc, kc, jr, ir;
+    int i;
+
+    for (i = 0; i < rows; i++) {
+        memset(C + (size_t)i * ldc, 0, B->cols * sizeof(double));
+    }
+
+    for (pc = 0; pc < A->cols; pc += GEMM_KC) {
+        kc = A->cols - pc < GEMM_KC ? A->cols - pc : GEMM_KC;
+        block = packed + (size_t)pc * padded_cols(B);
+
+        for (jr = 0; jr < B->cols; jr += GEMM_NR) {
+            for (ir = 0; ir < rows; ir += GEMM_MR) {
+                micro_kernel(kc, MATRIX_ROW(A, row + ir) + pc, A->stride,
+                             rows - ir < GEMM_MR ? rows - ir : GEMM_MR,
+                             block + (size_t)jr * kc,
+                             C + (size_t)ir * ldc + jr, ldc,
+                             B->cols - jr < GEMM_NR ? B->cols - jr : GEMM_NR);
+            }
+        }
+    }
+}
+
+
+static int padded_cols_float32(const matrix* B) {
+    /* Number of columns of B rounded up to whole panels of the single precision kernel */
+
+    return (B->cols + GEMM_NR_FLOAT32 - 1) / GEMM_NR_FLOAT32 * GEMM_NR_FLOAT32;
+}
+
+
+size_t gemm_packed_size_float32(const matrix* B) {
+    /* Number of floats gemm_pack_float32 needs to pack all of B */
+
+    return (size_t)B->rows * padded_cols_float32(B);
+}
+
+
+void gemm_pack_float32(const matrix* B, float* packed) {
+    /* Pack all of the float64 matrix B rounded to floats, in panels of GEMM_NR_FLOAT32 columns block by block
+    of GEMM_KC rows, for gemm_rows_float32. Columns past the end of B are padded with 0 */
+
+    const double* B_row;
+    float* panel;
+    int pc, kc, jr, p, j;
+
+    for (pc = 0; pc < B->rows; pc += GEMM_KC) {
+        kc = B->rows - pc < GEMM_KC ? B->rows - pc : GEMM_KC;
+
+        for (jr = 0; jr < B->cols; jr += GEMM_NR_FLOAT32) {
+            panel = packed + (size_t)pc * padded_cols_float32(B) + (size_t)jr * kc;
+
+            for (p = 0; p < kc; p++) {
+                B_row = MATRIX_ROW(B, pc + p) + jr;
+
+                for (j = 0; j < GEMM_NR_FLOAT32; j++) {
+                    panel[p * GEMM_NR_FLOAT32 + j] = jr + j < B->cols ? (float)B_row[j] : 0;
+                }
+            }
+        }
+    }
+}
+
+
+static void micro_kernel_float32(int kc, const float* A, size_t lda, int mr, const float* panel,
+                                 double* C, size_t ldc, int nr) {
+    /* micro_kernel in single precision: the mr x kc block of A times a packed kc x GEMM_NR_FLOAT32 panel is
+    summed in floats, and only the finished tile is added to C in doubles */
+
+    float c[GEMM_MR][GEMM_NR_FLOAT32];
+    const float* a[GEMM_MR];
+    const float* b;
+    int p, i, j;
+
+    memset(c, 0, sizeof(c));
+
+    if (mr == GEMM_MR) { /* full tile, every row of A read as its own stream */
+        for (i = 0; i < GEMM_MR; i++) {
+            a[i] = A + i * lda;
+        }
+
+        for (p = 0; p < kc; p++) {
+            b = panel + p * GEMM_NR_FLOAT32;
+
+            for (i = 0; i < GEMM_MR; i++) {
+                for (j = 0; j < GEMM_NR_FLOAT32; j++) {
+                    c[i][j] += a[i][p] * b[j];
+                }
+            }
+        }
+    }
+    else { /* last rows of A */
+        for (p = 0; p < kc; p++) {
+            b = panel + p * GEMM_NR_FLOAT32;
+
+            for (i = 0; i < mr; i++) {
+                for (j = 0; j < GEMM_NR_FLOAT32; j++) {
+                    c[i][j] += A[i * lda + p] * b[j];
+                }
+            }
+        }
+    }
+
+    /* Add the tile to C, leaving out the padding columns */
+    for (i = 0; i < mr; i++) {
+        for (j = 0; j < nr; j++) {
+            C[i * ldc + j] += c[i][j];
+        }
+    }
+}
+
+
+void gemm_rows_float32(const matrix* A, const matrix* B, const float* packed, int row, int rows, double* C,
+                       size_t ldc) {
+    /* gemm_rows for a MATRIX_FLOAT32, MATRIX_FLOAT16 or MATRIX_BFLOAT16 A, with B packed by gemm_pack_float32.
+    Rows of a 16-bit A are widened to floats one GEMM_MR x GEMM_KC tile at a time and the tile is reused for all
+    panels of B. Every block of GEMM_KC products is summed in floats, the blocks are added up in doubles */
+
+    float tile[GEMM_MR * GEMM_KC];
+    const float* block;
+    const float* a;
+    size_t lda;
+    int pc, kc, jr, ir, mr;
+    int i;
+
+    for (i = 0; i < rows; i++) {
+        memset(C + (size_t)i * ldc, 0, B->cols * sizeof(double));
+    }
+
+    for (pc = 0; pc < A->cols; pc += GEMM_KC) {
+        kc = A->cols - pc < GEMM_KC ? A->cols - pc : GEMM_KC;
+        block = packed + (size_t)pc * padded_cols_float32(B);
+
+        for (ir = 0; ir < rows; ir += GEMM_MR) {
+            mr = rows - ir < GEMM_MR ? rows - ir : GEMM_MR;
+            if (A->dtype == MATRIX_FLOAT32) {
+                a = MATRIX_ROW_FLOAT32(A, row + ir) + pc;
+                lda = A->stride;
+            }
+            else {
+                for (i = 0; i < mr; i++) {
+                    matrix_row_floats(A, row + ir + i, pc, kc, tile + i * GEMM_KC);
+                }
+                a = tile;
+                lda = GEMM_KC;
+            }
+
+            for (jr = 0; jr < B->cols; jr += GEMM_NR_FLOAT32) {
+                micro_kernel_float32(kc, a, lda, mr, block + (size_t)jr * kc, C + (size_t)ir * ldc + jr, ldc,
+                                     B->cols - jr < GEMM_NR_FLOAT32 ? B->cols - jr : GEMM_NR_FLOAT32);
+            }
+        }
+    }
+}
+
+
+int gemm(const matrix* A, const matrix* B, matrix* C) {
+    /* Calculate C = A * B for dense matrices of size n x r, r x m and n x m. Returns 0, or -1 if there isn't
+    enough memory for the packing buffer */
+
+    double* workspace;
+
+    /* Allocate the packing buffer for a block of B and check for errors */
+    workspace = (double*)malloc(gemm_workspace_size() * sizeof(double));
+    if (workspace == NULL) {
+        return -1;
+    }
+
+    gemm_workspace(A, B, C, workspace);
+
+    free(workspace);
+
+    return 0;
+}
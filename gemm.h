@@ -0,0 +1,28 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "matrix.h"
+
+/* Rows and columns of C computed together by the register kernel. A narrow tile wastes little on padding
+when B has only k (2 to ~20) columns, and still fills a vector register per row */
+#define GEMM_MR 4
+#define GEMM_NR 2
+/* Columns of the tile of the single precision kernel, a vector register holds twice as many floats */
+#define GEMM_NR_FLOAT32 4
+/* Cache blocking: KC x NC block of B packed to stay in L2/L3, MC x KC block of A reused from L2 */
+#define GEMM_KC 256
+#define GEMM_MC 64
+#define GEMM_NC 1024
+
+size_t gemm_workspace_size(void);
+void gemm_workspace(const matrix* A, const matrix* B, matrix* C, double* workspace);
+int gemm(const matrix* A, const matrix* B, matrix* C);
+size_t gemm_packed_size(const matrix* B);
+void gemm_pack(const matrix* B, double* packed);
+void gemm_rows(const matrix* A, const matrix* B, const double* packed, int row, int rows, double* C, size_t ldc);
+size_t gemm_packed_size_float32(const matrix* B);
+void gemm_pack_float32(const matrix* B, float* packed);
+void gemm_rows_float32(const matrix* A, const matrix* B, const float* packed, int row, int rows, double* C,
+                       size_t ldc);
+
+#endif
\ No newline at end of file
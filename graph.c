@@ -0,0 +1,628 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "graph.h"
+#include "spatial.h"
+#include "simd.h"
+#include "parallel.h"
+
+
+static int search_all_points(const matrix* X, int knn, neighbor* lists) {
+    /* Find the knn nearest other points of every point by comparing it with all of them. Used in high
+    dimensions, where a kd-tree can't skip much. Returns 0, or -1 if there isn't enough memory */
+
+    const simd_kernels* kernels;
+    matrix* XT;
+    double* distances;
+    neighbor candidate;
+    int n, size, failed;
+    int i, j;
+
+    n = X->rows;
+    kernels = simd_select();
+    XT = transpose(X);
+    if (XT == NULL) {
+        return -1;
+    }
+    failed = 0;
+
+    #pragma omp parallel private(distances, candidate, size, i, j) if ((double)n * n * X->cols > PARALLEL_MIN_WORK)
+    {
+        /* Allocate the distances of a point to all the others. The threads agree on a failure before the
+        loop, a thread can't leave a parallel region on its own */
+        distances = (double*)malloc(n * sizeof(double));
+        if (distances == NULL) {
+            #pragma omp atomic
+            failed++;
+        }
+        #pragma omp barrier
+
+        if (failed == 0) {
+            #pragma omp for schedule(dynamic, 16)
+            for (i = 0; i < n; i++) {
+                kernels->squared_distances(MATRIX_ROW(X, i), (const double*)XT->data, XT->stride, X->cols, n,
+                                           distances);
+
+                size = 0;
+                for (j = 0; j < n; j++) {
+                    if (j != i) {
+                        candidate.index = j;
+                        candidate.distance = distances[j];
+                        neighbor_offer(lists + (size_t)i * knn, &size, knn, candidate);
+                    }
+                }
+            }
+        }
+
+        free(distances);
+    }
+
+    free_matrix(XT);
+
+    return failed == 0 ? 0 : -1;
+}
+
+
+static int find_neighbors(const matrix* X, int knn, neighbor* lists) {
+    /* Find the knn nearest other points of every point, lists[i * knn] to lists[i * knn + knn - 1]. In low
+    dimensions a kd-tree answers every query in about O(log n) instead of O(n). Returns 0, or -1 if there
+    isn't enough memory */
+
+    kdtree* tree;
+    int i;
+
+    if (X->cols > KDTREE_MAX_DIM) {
+        return search_all_points(X, knn, lists);
+    }
+
+    tree = kdtree_build(X);
+    if (tree == NULL) {
+        return -1;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 64) if ((double)X->rows * knn * KDTREE_LEAF > PARALLEL_MIN_WORK)
+    for (i = 0; i < X->rows; i++) {
+        kdtree_knn(tree, MATRIX_ROW(X, i), i, knn, lists + (size_t)i * knn);
+    }
+
+    kdtree_free(tree);
+
+    return 0;
+}
+
+
+static int by_index(const void* a, const void* b) {
+    /* qsort order of neighbors by their index */
+
+    return ((const neighbor*)a)->index - ((const neighbor*)b)->index;
+}
+
+
+static matrix* symmetric_graph(int n, int knn, const neighbor* lists) {
+    /* Build the similarity matrix of the union of the neighbor lists in sparse form: cell (i, j) is stored
+    when j is one of the neighbors of i or i one of j, with value exp(-||xi - xj||^2 / 2). Returns NULL if
+    there isn't enough memory */
+
+    const simd_kernels* kernels;
+    matrix* A;
+    neighbor* candidates;
+    size_t* starts;
+    size_t* fill;
+    size_t p, end;
+    int i, j;
+
+    kernels = simd_select();
+
+    /* Allocate the candidate cells of every row: its own neighbors and the points it is a neighbor of */
+    candidates = (neighbor*)malloc((2 * (size_t)n * knn + 1) * sizeof(neighbor));
+    starts = (size_t*)calloc((size_t)n + 1, sizeof(size_t));
+    fill = (size_t*)malloc(((size_t)n + 1) * sizeof(size_t));
+    if (candidates == NULL || starts == NULL || fill == NULL) {
+        free(candidates);
+        free(starts);
+        free(fill);
+        return NULL;
+    }
+
+    /* Count the candidates of every row and where they start */
+    for (i = 0; i < n; i++) {
+        starts[i + 1] += knn;
+        for (p = (size_t)i * knn; p < (size_t)(i + 1) * knn; p++) {
+            starts[lists[p].index + 1]++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        starts[i + 1] += starts[i];
+        fill[i] = starts[i];
+    }
+
+    /* Put every pair in both of its rows, the distance is the same from both sides */
+    for (i = 0; i < n; i++) {
+        for (p = (size_t)i * knn; p < (size_t)(i + 1) * knn; p++) {
+            j = lists[p].index;
+            candidates[fill[i]++] = lists[p];
+            candidates[fill[j]].index = i;
+            candidates[fill[j]++].distance = lists[p].distance;
+        }
+    }
+
+    /* Sort every row by column and drop the pairs that were found from both sides, fill[i] is left with
+    the number of cells row i keeps */
+    #pragma omp parallel for private(p, end) schedule(dynamic, 64) if ((double)n * knn > PARALLEL_MIN_WORK)
+    for (i = 0; i < n; i++) {
+        qsort(candidates + starts[i], starts[i + 1] - starts[i], sizeof(neighbor), by_index);
+
+        end = starts[i];
+        for (p = starts[i]; p < starts[i + 1]; p++) {
+            if (end == starts[i] || candidates[end - 1].index != candidates[p].index) {
+                candidates[end++] = candidates[p];
+            }
+        }
+        fill[i] = end - starts[i];
+    }
+
+    /* Allocate the sparse matrix and copy the rows into it */
+    p = 0;
+    for (i = 0; i < n; i++) {
+        p += fill[i];
+    }
+    A = malloc_csr(n, n, p);
+    if (A == NULL) {
+        free(candidates);
+        free(starts);
+        free(fill);
+        return NULL;
+    }
+    A->offsets[0] = 0;
+    for (i = 0; i < n; i++) {
+        A->offsets[i + 1] = A->offsets[i] + fill[i];
+    }
+
+    #pragma omp parallel for private(p) schedule(static) if ((double)n * knn > PARALLEL_MIN_WORK)
+    for (i = 0; i < n; i++) {
+        for (p = 0; p < fill[i]; p++) {
+            A->indices[A->offsets[i] + p] = candidates[starts[i] + p].index;
+            ((double*)A->data)[A->offsets[i] + p] = candidates[starts[i] + p].distance;
+        }
+
+        /* Turn the squared distances of the row into similarities */
+        kernels->exp_neg_half((double*)A->data + A->offsets[i], (int)fill[i]);
+    }
+
+    free(candidates);
+    free(starts);
+    free(fill);
+
+    return A;
+}
+
+
+matrix* knn_similarity(const matrix* X, int knn) {
+    /* Calculate the similarity matrix of the knn nearest neighbor graph of the points of X, symmetrized so
+    a pair is kept if either point is among the knn nearest of the other. Stored sparse, O(n * knn) memory.
+    Returns NULL if there isn't enough memory */
+
+    matrix* A;
+    neighbor* lists;
+    int n;
+
+    n = X->rows;
+
+    /* A point has only n - 1 others */
+    if (knn > n - 1) {
+        knn = n - 1;
+    }
+
+    /* Allocate the neighbor lists and check for errors */
+    lists = (neighbor*)malloc(((size_t)n * knn + 1) * sizeof(neighbor));
+    if (lists == NULL) {
+        return NULL;
+    }
+
+    A = find_neighbors(X, knn, lists) == 0 ? symmetric_graph(n, knn, lists) : NULL;
+
+    free(lists);
+
+    return A;
+}
+
+
+static void report_truncation(const matrix* A, double cutoff, truncation_report* report) {
+    /* Fill the report of a cutoff similarity matrix: every left out cell is under the cutoff */
+
+    double row_sum, row_error;
+    size_t p, dropped;
+    int n, i;
+
+    n = A->rows;
+    report->kept = A->offsets[n];
+    report->dropped = (size_t)n * (n > 0 ? n - 1 : 0) - report->kept;
+    report->max_row_error = 0;
+    report->max_relative_row_error = 0;
+    report->frobenius_error = sqrt((double)report->dropped) * cutoff;
+
+    for (i = 0; i < n; i++) {
+        row_sum = 0;
+        for (p = A->offsets[i]; p < A->offsets[i + 1]; p++) {
+            row_sum += ((const double*)A->data)[p];
+        }
+
+        dropped = (size_t)(n - 1) - (A->offsets[i + 1] - A->offsets[i]);
+        row_error = (double)dropped * cutoff;
+
+        report->max_row_error = row_error > report->max_row_error ? row_error : report->max_row_error;
+        if (row_sum > 0 && row_error / row_sum > report->max_relative_row_error) {
+            report->max_relative_row_error = row_error / row_sum;
+        }
+    }
+}
+
+
+static int radius_rows(const matrix* X, const kdtree* tree, const matrix* XT, double squared_radius, int threads,
+                       neighbor_list* lists, size_t* counts, size_t* starts, int* owners) {
+    /* Find the points within the radius of every point, each thread appending the rows it takes to its own
+    list. Row i ends up as counts[i] items from starts[i] of lists[owners[i]]. Returns 0, or -1 if there isn't
+    enough memory */
+
+    const simd_kernels* kernels;
+    neighbor_list* list;
+    neighbor item;
+    double* distances;
+    size_t before;
+    int n, failed, thread_failed;
+    int i, j;
+
+    n = X->rows;
+    kernels = simd_select();
+    failed = 0;
+
+    #pragma omp parallel private(list, item, distances, before, thread_failed, i, j) num_threads(threads)
+    {
+        list = &lists[parallel_thread_id()];
+
+        /* Without the tree a row of distances is calculated at a time. A thread that runs out of memory skips
+        the rest of its rows, a thread can't leave a parallel region on its own */
+        distances = NULL;
+        thread_failed = tree == NULL && (distances = (double*)malloc(n * sizeof(double))) == NULL;
+
+        #pragma omp for schedule(dynamic, 64)
+        for (i = 0; i < n; i++) {
+            before = list->count;
+
+            if (tree != NULL && !thread_failed) {
+                thread_failed = kdtree_radius(tree, MATRIX_ROW(X, i), i, squared_radius, list) != 0;
+            }
+            else if (!thread_failed) {
+                kernels->squared_distances(MATRIX_ROW(X, i), (const double*)XT->data, XT->stride, X->cols, n,
+                                           distances);
+                for (j = 0; j < n && !thread_failed; j++) {
+                    if (j != i && distances[j] <= squared_radius) {
+                        item.index = j;
+                        item.distance = distances[j];
+                        thread_failed = neighbor_list_append(list, item) != 0;
+                    }
+                }
+            }
+
+            /* Columns in increasing order */
+            qsort(list->items + before, list->count - before, sizeof(neighbor), by_index);
+
+            counts[i] = list->count - before;
+            starts[i] = before;
+            owners[i] = parallel_thread_id();
+        }
+
+        free(distances);
+        if (thread_failed) {
+            #pragma omp atomic
+            failed++;
+        }
+    }
+
+    return failed == 0 ? 0 : -1;
+}
+
+
+static matrix* gather_rows(int n, const neighbor_list* lists, const size_t* counts, const size_t* starts,
+                           const int* owners) {
+    /* Copy the rows found by radius_rows into a sparse similarity matrix. Returns NULL if there isn't enough
+    memory */
+
+    const simd_kernels* kernels;
+    const neighbor_list* list;
+    matrix* A;
+    size_t p;
+    int i;
+
+    kernels = simd_select();
+
+    /* Allocate the sparse matrix and copy the rows into it */
+    p = 0;
+    for (i = 0; i < n; i++) {
+        p += counts[i];
+    }
+    A = malloc_csr(n, n, p);
+    if (A == NULL) {
+        return NULL;
+    }
+    A->offsets[0] = 0;
+    for (i = 0; i < n; i++) {
+        A->offsets[i + 1] = A->offsets[i] + counts[i];
+    }
+
+    #pragma omp parallel for private(list, p) schedule(static) if ((double)A->offsets[n] > PARALLEL_MIN_WORK)
+    for (i = 0; i < n; i++) {
+        list = &lists[owners[i]];
+
+        for (p = 0; p < counts[i]; p++) {
+            A->indices[A->offsets[i] + p] = list->items[starts[i] + p].index;
+            ((double*)A->data)[A->offsets[i] + p] = list->items[starts[i] + p].distance;
+        }
+
+        /* Turn the squared distances of the row into similarities */
+        kernels->exp_neg_half((double*)A->data + A->offsets[i], (int)counts[i]);
+    }
+
+    return A;
+}
+
+
+matrix* cutoff_similarity(const matrix* X, double cutoff, truncation_report* report) {
+    /* Calculate the similarity matrix without the cells under cutoff (0 < cutoff < 1), stored sparse. A cell
+    is kept when exp(-||xi - xj||^2 / 2) >= cutoff, that is ||xi - xj||^2 <= -2 * ln(cutoff), and only the
+    pairs within that radius are ever looked at: a kd-tree radius query per point, or a scan over all points
+    in high dimensions. If report isn't NULL it is filled with bounds on what was left out. Returns NULL if
+    there isn't enough memory */
+
+    kdtree* tree;
+    matrix* XT;
+    matrix* A;
+    neighbor_list* lists;
+    size_t* counts;
+    size_t* starts;
+    int* owners;
+    int n, threads;
+    int t;
+
+    n = X->rows;
+    threads = parallel_threads();
+    tree = NULL;
+    XT = NULL;
+    A = NULL;
+
+    /* Allocate where every row ends up: the list of the thread that found it and its place there */
+    lists = (neighbor_list*)calloc(threads, sizeof(neighbor_list));
+    counts = (size_t*)malloc(((size_t)n + 1) * sizeof(size_t));
+    starts = (size_t*)malloc(((size_t)n + 1) * sizeof(size_t));
+    owners = (int*)malloc(((size_t)n + 1) * sizeof(int));
+
+    if (lists != NULL && counts != NULL && starts != NULL && owners != NULL) {
+        tree = X->cols <= KDTREE_MAX_DIM ? kdtree_build(X) : NULL;
+        XT = X->cols <= KDTREE_MAX_DIM ? NULL : transpose(X);
+
+        if ((tree != NULL || XT != NULL) &&
+            radius_rows(X, tree, XT, -2 * log(cutoff), threads, lists, counts, starts, owners) == 0) {
+            A = gather_rows(n, lists, counts, starts, owners);
+        }
+    }
+
+    if (A != NULL && report != NULL) {
+        report_truncation(A, cutoff, report);
+    }
+
+    /* Free memory */
+    for (t = 0; lists != NULL && t < threads; t++) {
+        free(lists[t].items);
+    }
+    free(lists);
+    free(counts);
+    free(starts);
+    free(owners);
+    if (tree != NULL) {
+        kdtree_free(tree);
+    }
+    free_matrix(XT);
+
+    return A;
+}
+
+
+static double gaussian(const double* x, const double* y, int d) {
+    /* exp(-||x - y||^2 / 2), the similarity of two points */
+
+    double sum, difference;
+    int p;
+
+    sum = 0;
+    for (p = 0; p < d; p++) {
+        difference = x[p] - y[p];
+        sum += difference * difference;
+    }
+
+    return exp(-sum / 2);
+}
+
+
+static int choose_candidates(int n, int m, int* candidates) {
+    /* Pick m different points out of n pseudo randomly (the first m of a partial Fisher-Yates shuffle with a
+    fixed linear congruential generator). Returns 0, or -1 if there isn't enough memory */
+
+    unsigned long state;
+    int* order;
+    int i, j, swap;
+
+    order = (int*)malloc(((size_t)n + 1) * sizeof(int));
+    if (order == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        order[i] = i;
+    }
+
+    state = NYSTROM_SEED;
+    for (i = 0; i < m; i++) {
+        state = (state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+        j = i + (int)(state % (unsigned long)(n - i));
+
+        swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+        candidates[i] = order[i];
+    }
+
+    free(order);
+
+    return 0;
+}
+
+
+static int pivoted_cholesky(const matrix* K, int* pivots, matrix* L) {
+    /* Factor the landmark kernel K (m x m, symmetric positive semidefinite) as L * L^t one pivot at a time,
+    always on the landmark it explains least so far, until what is left is under NYSTROM_TOLERANCE. Returns
+    the rank r: pivots[0..r - 1] are the landmarks used, and L(pivots[s], t) for t <= s is their triangular
+    factor. Returns -1 if there isn't enough memory */
+
+    double* residual;
+    double sum;
+    int m, rank;
+    int s, t, q, best;
+
+    m = K->rows;
+
+    residual = (double*)malloc(((size_t)m + 1) * sizeof(double));
+    if (residual == NULL) {
+        return -1;
+    }
+
+    for (q = 0; q < m; q++) {
+        residual[q] = MATRIX_AT(K, q, q);
+        pivots[q] = q;
+    }
+
+    for (rank = 0; rank < m; rank++) {
+        /* The landmark explained least, among those not used yet */
+        best = rank;
+        for (q = rank + 1; q < m; q++) {
+            if (residual[pivots[q]] > residual[pivots[best]]) {
+                best = q;
+            }
+        }
+        if (residual[pivots[best]] <= NYSTROM_TOLERANCE) {
+            break;
+        }
+
+        s = pivots[best];
+        pivots[best] = pivots[rank];
+        pivots[rank] = s;
+
+        /* New column of L: the part of every other landmark the pivot explains */
+        MATRIX_AT(L, s, rank) = sqrt(residual[s]);
+        for (q = rank + 1; q < m; q++) {
+            sum = MATRIX_AT(K, pivots[q], s);
+            for (t = 0; t < rank; t++) {
+                sum -= MATRIX_AT(L, pivots[q], t) * MATRIX_AT(L, s, t);
+            }
+
+            MATRIX_AT(L, pivots[q], rank) = sum / MATRIX_AT(L, s, rank);
+            residual[pivots[q]] -= MATRIX_AT(L, pivots[q], rank) * MATRIX_AT(L, pivots[q], rank);
+        }
+    }
+
+    free(residual);
+
+    return rank;
+}
+
+
+static void landmark_kernel(const matrix* X, const int* candidates, matrix* K) {
+    /* The similarities of the candidates among themselves, 1 on the diagonal */
+
+    int a, b;
+
+    for (a = 0; a < K->rows; a++) {
+        MATRIX_AT(K, a, a) = 1;
+        for (b = a + 1; b < K->rows; b++) {
+            MATRIX_AT(K, a, b) = gaussian(MATRIX_ROW(X, candidates[a]), MATRIX_ROW(X, candidates[b]), X->cols);
+            MATRIX_AT(K, b, a) = MATRIX_AT(K, a, b);
+        }
+    }
+}
+
+
+static void nystrom_rows(const matrix* X, const int* candidates, const int* pivots, const matrix* L, matrix* A) {
+    /* Row i of F solves L_r * F_i = C_i by forward substitution, over the landmarks in pivot order, and c_i is
+    ||F_i||^2, the diagonal F * F^t actually has */
+
+    double* F_row;
+    double sum, diagonal;
+    int n, rank;
+    int i, s, t;
+
+    n = X->rows;
+    rank = A->rank;
+
+    #pragma omp parallel for private(F_row, sum, diagonal, s, t) schedule(static) \
+        if ((double)n * rank * (rank + X->cols) > PARALLEL_MIN_WORK)
+    for (i = 0; i < n; i++) {
+        F_row = MATRIX_ROW(A, i);
+        diagonal = 0;
+
+        for (s = 0; s < rank; s++) {
+            sum = gaussian(MATRIX_ROW(X, i), MATRIX_ROW(X, candidates[pivots[s]]), X->cols);
+            for (t = 0; t < s; t++) {
+                sum -= MATRIX_AT(L, pivots[s], t) * F_row[t];
+            }
+
+            F_row[s] = sum / MATRIX_AT(L, pivots[s], s);
+            diagonal += F_row[s] * F_row[s];
+        }
+
+        MATRIX_LOW_RANK_DIAGONAL(A)[i] = diagonal;
+    }
+}
+
+
+matrix* nystrom_similarity(const matrix* X, int landmarks) {
+    /* Approximate the similarity matrix from landmarks sampled points as F * F^t - diag(c), a low rank matrix.
+    With C the n x m similarities to the landmarks and K = L * L^t their own similarities, the Nystrom
+    approximation of the kernel is C * K^-1 * C^t = F * F^t for F = C * L^-t; c removes its diagonal, where
+    the similarity matrix has 0. That diagonal is ||F_i||^2 rather than the kernel's 1, it is much smaller for
+    points far from every landmark, and subtracting 1 there would leave them a large negative similarity.
+    Memory and the cost of a product with it are O(n * rank). Returns NULL if there isn't enough memory */
+
+    matrix* K;
+    matrix* L;
+    matrix* A;
+    int* candidates;
+    int* pivots;
+    int n, m, rank;
+
+    n = X->rows;
+    m = landmarks < n ? landmarks : n;
+
+    /* Allocate the landmarks and their kernel, and check for errors */
+    candidates = (int*)malloc(((size_t)m + 1) * sizeof(int));
+    pivots = (int*)malloc(((size_t)m + 1) * sizeof(int));
+    K = malloc_matrix(m, m);
+    L = malloc_matrix(m, m);
+    A = NULL;
+
+    if (candidates != NULL && pivots != NULL && K != NULL && L != NULL && choose_candidates(n, m, candidates) == 0) {
+        landmark_kernel(X, candidates, K);
+        rank = pivoted_cholesky(K, pivots, L);
+
+        A = rank >= 0 ? malloc_low_rank(n, rank) : NULL;
+        if (A != NULL) {
+            nystrom_rows(X, candidates, pivots, L, A);
+        }
+    }
+
+    /* Free memory */
+    free_matrix(K);
+    free_matrix(L);
+    free(candidates);
+    free(pivots);
+
+    return A;
+}
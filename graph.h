@@ -0,0 +1,26 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "matrix.h"
+
+/* Pivots of the Nystrom landmarks are taken while the part of the landmark kernel left to explain is above this,
+beyond it the remaining landmarks are (numerically) combinations of the chosen ones */
+#define NYSTROM_TOLERANCE 1e-10
+/* Seed of the pseudo random choice of the landmarks, fixed so runs are repeatable */
+#define NYSTROM_SEED 12345UL
+
+/* How much a cutoff similarity matrix left out. Every cell off the diagonal that isn't stored is under the
+cutoff, which bounds the error */
+typedef struct {
+    size_t kept; /* cells off the diagonal stored */
+    size_t dropped; /* cells off the diagonal left out */
+    double max_row_error; /* most any row sum (degree) can have lost */
+    double max_relative_row_error; /* the same relative to the row sum, over the rows with a positive sum */
+    double frobenius_error; /* most the frobenius norm of the left out cells can be */
+} truncation_report;
+
+matrix* knn_similarity(const matrix* X, int knn);
+matrix* cutoff_similarity(const matrix* X, double cutoff, truncation_report* report);
+matrix* nystrom_similarity(const matrix* X, int landmarks);
+
+#endif
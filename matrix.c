@@ -0,0 +1,1027 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "matrix.h"
+#include "gemm.h"
+#include "parallel.h"
+#include "simd.h"
+#include "storage.h"
+
+
+static size_t row_stride(int m, size_t size) {
+    /* Number of elements of size bytes to reserve for a row of length m */
+
+    size_t per_line;
+
+    /* Rows at least a cache line long are padded so every row starts on a cache line,
+    narrow matrices (like H) stay dense so they don't waste memory and bandwidth */
+    per_line = MATRIX_ALIGNMENT / size;
+    if ((size_t)m < per_line) {
+        return (size_t)m;
+    }
+
+    return ((size_t)m + per_line - 1) / per_line * per_line;
+}
+
+
+static matrix* allocate_matrix(size_t cells, size_t size) {
+    /* Allocate a matrix header and an aligned buffer of the given number of cells of size bytes in a single
+    allocation. Returns NULL if there isn't enough memory, as do all the allocating functions of the library */
+
+    matrix* A;
+    size_t offset;
+    char* buffer;
+
+    /* Allocate the header, room to align the cells and the cells themselves, and check for errors */
+    buffer = (char*)malloc(sizeof(matrix) + MATRIX_ALIGNMENT + cells * size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    /* The cells start at the first aligned address after the header */
+    A = (matrix*)buffer;
+    offset = sizeof(matrix) + MATRIX_ALIGNMENT - ((size_t)(buffer + sizeof(matrix)) % MATRIX_ALIGNMENT);
+
+    A->dtype = MATRIX_FLOAT64;
+    A->data = buffer + offset;
+    A->offsets = NULL;
+    A->indices = NULL;
+    A->rank = 0;
+    A->mapped_bytes = 0;
+
+    return A;
+}
+
+
+matrix* malloc_matrix(int n, int m) {
+    /* Allocate memory for a n * m matrix of doubles */
+
+    matrix* A;
+    size_t stride;
+
+    stride = row_stride(m, sizeof(double));
+    A = allocate_matrix((size_t)n * stride, sizeof(double));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = m;
+    A->stride = stride;
+    A->layout = MATRIX_DENSE;
+
+    return A;
+}
+
+
+static size_t dtype_size(matrix_dtype dtype) {
+    /* Number of bytes of an element */
+
+    if (dtype == MATRIX_FLOAT32) {
+        return sizeof(float);
+    }
+    if (dtype == MATRIX_FLOAT16 || dtype == MATRIX_BFLOAT16) {
+        return sizeof(unsigned short);
+    }
+
+    return sizeof(double);
+}
+
+
+matrix* malloc_matrix_dtype(int n, int m, matrix_dtype dtype) {
+    /* Allocate memory for a n * m matrix of the given element type */
+
+    matrix* A;
+    size_t stride;
+
+    stride = row_stride(m, dtype_size(dtype));
+    A = allocate_matrix((size_t)n * stride, dtype_size(dtype));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = m;
+    A->stride = stride;
+    A->dtype = dtype;
+    A->layout = MATRIX_DENSE;
+
+    return A;
+}
+
+
+int matrix_dtype_from_name(const char* name, matrix_dtype* dtype) {
+    /* The element type a precision is named by: "double", "single", "half" or "bfloat16". Returns 0, or -1 for
+    an unknown name */
+
+    if (strcmp(name, "double") == 0) {
+        *dtype = MATRIX_FLOAT64;
+        return 0;
+    }
+    if (strcmp(name, "single") == 0) {
+        *dtype = MATRIX_FLOAT32;
+        return 0;
+    }
+    if (strcmp(name, "half") == 0) {
+        *dtype = MATRIX_FLOAT16;
+        return 0;
+    }
+    if (strcmp(name, "bfloat16") == 0) {
+        *dtype = MATRIX_BFLOAT16;
+        return 0;
+    }
+
+    return -1;
+}
+
+
+matrix* malloc_diagonal(int n) {
+    /* Allocate memory for a n * n diagonal matrix, only the n cells of the diagonal are stored */
+
+    matrix* A;
+
+    A = allocate_matrix((size_t)n, sizeof(double));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = n;
+    A->stride = 0;
+    A->layout = MATRIX_DIAGONAL;
+
+    return A;
+}
+
+
+matrix* malloc_packed(int n) {
+    /* Allocate memory for a n * n symmetric matrix, only the n * (n + 1) / 2 cells of the upper triangle are stored */
+
+    matrix* A;
+
+    A = allocate_matrix((size_t)n * ((size_t)n + 1) / 2, sizeof(double));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = n;
+    A->stride = 0;
+    A->layout = MATRIX_PACKED;
+
+    return A;
+}
+
+
+matrix* malloc_csr(int n, int m, size_t nonzeros) {
+    /* Allocate memory for a sparse n * m matrix with the given number of stored cells. The values, the row
+    offsets and the column indices all follow the header in the same allocation */
+
+    matrix* A;
+    size_t cells;
+
+    /* Reserve whole doubles for the offsets and the indices after the values, so every array stays aligned */
+    cells = nonzeros + ((size_t)n + 1) + (nonzeros * sizeof(int) + sizeof(double) - 1) / sizeof(double);
+    A = allocate_matrix(cells, sizeof(double));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = m;
+    A->stride = 0;
+    A->layout = MATRIX_CSR;
+    A->offsets = (size_t*)((double*)A->data + nonzeros);
+    A->indices = (int*)(A->offsets + n + 1);
+
+    return A;
+}
+
+
+matrix* malloc_low_rank(int n, int rank) {
+    /* Allocate memory for a n * n matrix held as G * G^t - diag(c), with G of size n x rank */
+
+    matrix* A;
+    size_t stride;
+
+    stride = row_stride(rank, sizeof(double));
+    A = allocate_matrix((size_t)n * stride + (size_t)n, sizeof(double));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = n;
+    A->stride = stride;
+    A->layout = MATRIX_LOW_RANK;
+    A->rank = rank;
+
+    return A;
+}
+
+
+matrix* wrap_matrix(double* data, int n, int m, size_t stride) {
+    /* A dense n x m matrix over cells owned by the caller, stride elements between rows. Only the header is
+    allocated, and only it is freed by free_matrix */
+
+    matrix* A;
+
+    A = (matrix*)malloc(sizeof(matrix));
+    if (A == NULL) {
+        return NULL;
+    }
+
+    A->rows = n;
+    A->cols = m;
+    A->stride = stride;
+    A->dtype = MATRIX_FLOAT64;
+    A->layout = MATRIX_DENSE;
+    A->data = data;
+    A->offsets = NULL;
+    A->indices = NULL;
+    A->rank = 0;
+    A->mapped_bytes = 0;
+
+    return A;
+}
+
+
+void free_matrix(matrix* A) {
+    /* Free all memory used by a matrix, nothing for NULL like free */
+
+    if (A == NULL) {
+        return;
+    }
+
+    /* A mapped matrix has its header apart from the mapping */
+    if (A->mapped_bytes > 0) {
+        unmap_matrix(A);
+    }
+
+    /* The header is the start of the allocation (or all of it for a wrapped or mapped matrix) */
+    free(A);
+}
+
+
+static float bits_to_float(unsigned int bits) {
+    /* The float with the given bit pattern */
+
+    float value;
+
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+
+static unsigned short float_to_half(float value) {
+    /* Round a float to the nearest half precision number, ties to even */
+
+    unsigned int bits, sign, mantissa, rest, halfway;
+    unsigned int half;
+    int shift;
+
+    memcpy(&bits, &value, sizeof(bits));
+    sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    if (bits >= 0x7f800000) { /* infinity, NaN stays a (quiet) NaN */
+        return (unsigned short)(sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0));
+    }
+    if (bits >= 0x477ff000) { /* from 65520 on it rounds past the largest half, 65504 */
+        return (unsigned short)(sign | 0x7c00);
+    }
+    if (bits < 0x33000000) { /* up to 2^-25 it rounds to 0 */
+        return (unsigned short)sign;
+    }
+
+    if (bits < 0x38800000) { /* under 2^-14 it becomes a subnormal half, in units of 2^-24 */
+        mantissa = (bits & 0x7fffff) | 0x800000;
+        shift = 126 - (int)(bits >> 23);
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else { /* rebias the exponent from 127 to 15 and drop 13 bits of the mantissa */
+        bits -= 0x38000000;
+        half = bits >> 13;
+        rest = bits & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    /* Rounding up may carry into the exponent, which is still right */
+    if (rest > halfway || (rest == halfway && (half & 1) != 0)) {
+        half++;
+    }
+
+    return (unsigned short)(sign | half);
+}
+
+
+static unsigned short float_to_bfloat16(float value) {
+    /* Round a float to the nearest bfloat16 (its upper 16 bits), ties to even */
+
+    unsigned int bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) { /* NaN stays a (quiet) NaN */
+        return (unsigned short)((bits >> 16) | 0x40);
+    }
+
+    return (unsigned short)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+
+static double csr_get(const matrix* A, int i, int j) {
+    /* Read cell (i, j) of a sparse matrix */
+
+    size_t low, high, middle;
+
+    low = A->offsets[i];
+    high = A->offsets[i + 1];
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+
+        if (A->indices[middle] == j) {
+            return ((const double*)A->data)[middle];
+        }
+        if (A->indices[middle] < j) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return 0;
+}
+
+
+static double low_rank_get(const matrix* A, int i, int j) {
+    /* Read cell (i, j) of a low rank matrix, the product of rows i and j of the factor */
+
+    double result;
+    int p;
+
+    result = 0;
+    for (p = 0; p < A->rank; p++) {
+        result += MATRIX_AT(A, i, p) * MATRIX_AT(A, j, p);
+    }
+
+    return i == j ? result - MATRIX_LOW_RANK_DIAGONAL(A)[i] : result;
+}
+
+
+double matrix_get(const matrix* A, int i, int j) {
+    /* Read cell (i, j) of a matrix of any layout */
+
+    float single;
+
+    if (A->layout == MATRIX_DIAGONAL) { /* cells outside the diagonal are 0 */
+        return i == j ? ((const double*)A->data)[i] : 0;
+    }
+
+    if (A->layout == MATRIX_PACKED) { /* cells under the diagonal are read from their mirror */
+        return i <= j ? MATRIX_PACKED_ROW(A, i)[j - i] : MATRIX_PACKED_ROW(A, j)[i - j];
+    }
+
+    if (A->layout == MATRIX_CSR) { /* binary search of the sorted columns of row i, cells not stored are 0 */
+        return csr_get(A, i, j);
+    }
+
+    if (A->layout == MATRIX_LOW_RANK) {
+        return low_rank_get(A, i, j);
+    }
+
+    if (A->dtype == MATRIX_FLOAT32) {
+        return MATRIX_AT_FLOAT32(A, i, j);
+    }
+    if (A->dtype == MATRIX_FLOAT16) {
+        simd_select()->halves_to_floats((const unsigned short*)A->data + (size_t)i * A->stride + j, 1, &single);
+        return single;
+    }
+    if (A->dtype == MATRIX_BFLOAT16) {
+        return bits_to_float((unsigned int)((const unsigned short*)A->data)[(size_t)i * A->stride + j] << 16);
+    }
+
+    return MATRIX_AT(A, i, j);
+}
+
+
+void matrix_set(matrix* A, int i, int j, double value) {
+    /* Write cell (i, j) of a dense matrix of any element type, rounded to it */
+
+    if (A->dtype == MATRIX_FLOAT32) {
+        MATRIX_AT_FLOAT32(A, i, j) = (float)value;
+    }
+    else if (A->dtype == MATRIX_FLOAT16) {
+        ((unsigned short*)A->data)[(size_t)i * A->stride + j] = float_to_half((float)value);
+    }
+    else if (A->dtype == MATRIX_BFLOAT16) {
+        ((unsigned short*)A->data)[(size_t)i * A->stride + j] = float_to_bfloat16((float)value);
+    }
+    else {
+        MATRIX_AT(A, i, j) = value;
+    }
+}
+
+
+void matrix_row_floats(const matrix* A, int i, int j, int count, float* out) {
+    /* Widen cells j to j + count - 1 of row i of a dense float32, float16 or bfloat16 matrix into out. Widening
+    is exact, so a product summed from them only rounds in the sums */
+
+    const unsigned short* cells;
+    int p;
+
+    if (A->dtype == MATRIX_FLOAT32) {
+        memcpy(out, MATRIX_ROW_FLOAT32(A, i) + j, (size_t)count * sizeof(float));
+        return;
+    }
+
+    cells = (const unsigned short*)A->data + (size_t)i * A->stride + j;
+    if (A->dtype == MATRIX_BFLOAT16) {
+        for (p = 0; p < count; p++) {
+            out[p] = bits_to_float((unsigned int)cells[p] << 16);
+        }
+    }
+    else {
+        simd_select()->halves_to_floats(cells, count, out);
+    }
+}
+
+
+matrix submatrix(const matrix* A, int row, int col, int rows, int cols) {
+    /* A view of the rows x cols block of a dense matrix starting at (row, col). The view shares the buffer
+    of A, so it is only valid while A is and must not be freed */
+
+    matrix B;
+
+    B = *A;
+    B.rows = rows;
+    B.cols = cols;
+    B.data = MATRIX_ROW(A, row) + col;
+
+    return B;
+}
+
+
+void transpose_into(const matrix* A, matrix* B) {
+    /* Write the transpose of an n x m matrix into an m x n matrix */
+
+    int i, j;
+
+    #pragma omp parallel for private(j) schedule(static) if ((double)A->rows * A->cols > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        for (j = 0; j < A->cols; j++) {
+            MATRIX_AT(B, j, i) = MATRIX_AT(A, i, j);
+        }
+    }
+}
+
+
+matrix* transpose(const matrix* A) {
+    /* Transpose an n x m matrix */
+
+    matrix* B;
+
+    /* Allocate memory for matrix and calculate the transpose of the given matrix into it */
+    B = malloc_matrix(A->cols, A->rows);
+    if (B == NULL) {
+        return NULL;
+    }
+    transpose_into(A, B);
+
+    return B;
+}
+
+
+matrix* convert_matrix(const matrix* A, matrix_dtype dtype) {
+    /* Copy a matrix of any layout into a new dense one of the given element type, rounding to the nearest
+    number of it when narrowing */
+
+    matrix* B;
+    int i, j;
+
+    /* Allocate memory for matrix and copy the cells of the given matrix into it */
+    B = malloc_matrix_dtype(A->rows, A->cols, dtype);
+    if (B == NULL) {
+        return NULL;
+    }
+
+    #pragma omp parallel for private(j) schedule(static) if ((double)A->rows * A->cols > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        for (j = 0; j < A->cols; j++) {
+            matrix_set(B, i, j, matrix_get(A, i, j));
+        }
+    }
+
+    return B;
+}
+
+
+static void symmetric_rows(const matrix* A, const matrix* B, int i, double* C, size_t ldc) {
+    /* Add what the stored cells of row i of a packed symmetric matrix A contribute to A * B into C: every
+    cell (i, j) contributes to row i, and for j > i also as cell (j, i) to row j */
+    const double* A_row;
+    const double* B_i;
+    const double* B_j;
+    double* C_i;
+    double* C_j;
+    double a;
+    int j, k;
+
+    A_row = MATRIX_PACKED_ROW(A, i);
+    B_i = MATRIX_ROW(B, i);
+    C_i = C + (size_t)i * ldc;
+
+    for (k = 0; k < B->cols; k++) {
+        C_i[k] += A_row[0] * B_i[k];
+    }
+
+    for (j = i + 1; j < A->cols; j++) {
+        a = A_row[j - i];
+        B_j = MATRIX_ROW(B, j);
+        C_j = C + (size_t)j * ldc;
+
+        for (k = 0; k < B->cols; k++) {
+            C_i[k] += a * B_j[k];
+            C_j[k] += a * B_i[k];
+        }
+    }
+}
+
+
+static int symmetric_threads(const matrix* A, const matrix* B) {
+    /* Number of threads symmetric_multiplication splits A * B over */
+
+    return (double)A->rows * A->rows * B->cols > 2 * PARALLEL_MIN_WORK ? parallel_threads() : 1;
+}
+
+
+static void symmetric_multiplication(const matrix* A, const matrix* B, matrix* C, double* partial) {
+    /* Multiply a packed symmetric matrix of size n x n by a matrix of size n x m into C. A row of A adds to
+    many rows of the result, so every thread but the first sums into its own copy in partial, added up at the end.
+    A mapped A is streamed from its file a panel of rows at a time */
+    double* target;
+    size_t size;
+    int threads, panel_rows;
+    int panel, end;
+    int i, k, t;
+
+    threads = symmetric_threads(A, B);
+    size = (size_t)A->rows * B->cols;
+    panel_rows = A->mapped_bytes > 0 ? MATRIX_PANEL_ROWS : (A->rows > 0 ? A->rows : 1);
+
+    /* Every copy starts from 0 */
+    #pragma omp parallel for private(k, t) schedule(static) num_threads(threads)
+    for (i = 0; i < C->rows; i++) {
+        for (k = 0; k < C->cols; k++) {
+            MATRIX_AT(C, i, k) = 0;
+        }
+        for (t = 1; t < threads; t++) {
+            for (k = 0; k < C->cols; k++) {
+                partial[(t - 1) * size + (size_t)i * C->cols + k] = 0;
+            }
+        }
+    }
+
+    #pragma omp parallel private(target, panel, end, i, t) num_threads(threads)
+    {
+        t = parallel_thread_id();
+        target = t == 0 ? (double*)C->data : partial + (t - 1) * size;
+
+        for (panel = 0; panel < A->rows; panel += panel_rows) {
+            end = panel + panel_rows < A->rows ? panel + panel_rows : A->rows;
+
+            /* Have the next panel read from the file while this one is used */
+            #pragma omp single nowait
+            advise_rows(A, end, panel_rows, MATRIX_WILLNEED);
+
+            /* Rows high in the triangle are longer, dealing them out in small chunks keeps the threads balanced */
+            #pragma omp for schedule(static, 16)
+            for (i = panel; i < end; i++) {
+                symmetric_rows(A, B, i, target, t == 0 ? C->stride : (size_t)B->cols);
+            }
+
+            /* Every thread is done with the panel, it won't be read again until the next product */
+            #pragma omp single nowait
+            advise_rows(A, panel, end - panel, MATRIX_DONTNEED);
+        }
+    }
+
+    /* Add up the copies */
+    #pragma omp parallel for private(k, t) schedule(static) num_threads(threads)
+    for (i = 0; i < C->rows; i++) {
+        for (t = 1; t < threads; t++) {
+            for (k = 0; k < C->cols; k++) {
+                MATRIX_AT(C, i, k) += partial[(t - 1) * size + (size_t)i * C->cols + k];
+            }
+        }
+    }
+}
+
+
+void csr_rows(const matrix* A, const matrix* B, int row, int rows, double* C, size_t ldc) {
+    /* Calculate rows row to row + rows - 1 of A * B for a sparse A into C (rows x m, ldc elements between
+    rows) on the calling thread. Every stored cell of A adds a row of B to its row of C */
+
+    const double* values;
+    const double* B_row;
+    double* C_row;
+    double a;
+    size_t p;
+    int i, k;
+
+    values = (const double*)A->data;
+
+    for (i = 0; i < rows; i++) {
+        C_row = C + (size_t)i * ldc;
+
+        for (k = 0; k < B->cols; k++) {
+            C_row[k] = 0;
+        }
+
+        for (p = A->offsets[row + i]; p < A->offsets[row + i + 1]; p++) {
+            a = values[p];
+            B_row = MATRIX_ROW(B, A->indices[p]);
+
+            for (k = 0; k < B->cols; k++) {
+                C_row[k] += a * B_row[k];
+            }
+        }
+    }
+}
+
+
+static int transposed_threads(const matrix* A, const matrix* B) {
+    /* Number of threads transposed_multiply_into splits A^t * B over */
+
+    return (double)A->rows * A->cols * B->cols > PARALLEL_MIN_WORK ? parallel_threads() : 1;
+}
+
+
+size_t transposed_workspace_size(const matrix* A, const matrix* B) {
+    /* Number of doubles of scratch memory transposed_multiply_into needs for A^t * B */
+
+    return (size_t)transposed_threads(A, B) * A->cols * B->cols;
+}
+
+
+void transposed_multiply_into(const matrix* A, const matrix* B, matrix* C, double* workspace) {
+    /* Calculate A^t * B (r x m) for dense A and B of size n x r and n x m, both tall, without transposing A.
+    Every thread sums its rows into its own copy in workspace, added up in thread order at the end so the
+    result only depends on the number of threads */
+
+    const double* A_row;
+    const double* B_row;
+    double* partial;
+    size_t size;
+    int threads;
+    int i, a, b, t;
+
+    threads = transposed_threads(A, B);
+    size = (size_t)A->cols * B->cols;
+
+    /* The copies start from 0, also the ones of threads OpenMP might not start */
+    memset(workspace, 0, threads * size * sizeof(double));
+
+    #pragma omp parallel private(partial, A_row, B_row, i, a, b) num_threads(threads)
+    {
+        partial = workspace + (size_t)parallel_thread_id() * size;
+
+        #pragma omp for schedule(static)
+        for (i = 0; i < A->rows; i++) {
+            A_row = MATRIX_ROW(A, i);
+            B_row = MATRIX_ROW(B, i);
+
+            for (a = 0; a < A->cols; a++) {
+                for (b = 0; b < B->cols; b++) {
+                    partial[a * B->cols + b] += A_row[a] * B_row[b];
+                }
+            }
+        }
+    }
+
+    for (a = 0; a < A->cols; a++) {
+        for (b = 0; b < B->cols; b++) {
+            MATRIX_AT(C, a, b) = 0;
+            for (t = 0; t < threads; t++) {
+                MATRIX_AT(C, a, b) += workspace[t * size + a * B->cols + b];
+            }
+        }
+    }
+}
+
+
+void low_rank_rows(const matrix* A, const matrix* B, const matrix* GtB, int row, int rows, double* C, size_t ldc) {
+    /* Calculate rows row to row + rows - 1 of A * B for a low rank A = G * G^t - diag(c) into C on the calling
+    thread, given GtB = G^t * B (rank x m): every row is a row of G times GtB, minus c times the row of B */
+
+    const double* G_row;
+    const double* B_row;
+    double* C_row;
+    double c;
+    int i, p, k;
+
+    for (i = 0; i < rows; i++) {
+        G_row = MATRIX_ROW(A, row + i);
+        B_row = MATRIX_ROW(B, row + i);
+        C_row = C + (size_t)i * ldc;
+        c = MATRIX_LOW_RANK_DIAGONAL(A)[row + i];
+
+        for (k = 0; k < B->cols; k++) {
+            C_row[k] = -c * B_row[k];
+        }
+
+        for (p = 0; p < A->rank; p++) {
+            for (k = 0; k < B->cols; k++) {
+                C_row[k] += G_row[p] * MATRIX_AT(GtB, p, k);
+            }
+        }
+    }
+}
+
+
+matrix low_rank_factor(const matrix* A) {
+    /* A view of the factor G of a low rank matrix as a dense rows x rank matrix */
+
+    matrix G;
+
+    G = *A;
+    G.cols = A->rank;
+    G.layout = MATRIX_DENSE;
+
+    return G;
+}
+
+
+static matrix factor_product(const matrix* A, const matrix* B, double* workspace) {
+    /* A view of the first rank x m doubles of workspace as a dense matrix, where G^t * B of a low rank A goes */
+
+    matrix GtB;
+
+    GtB = *B;
+    GtB.rows = A->rank;
+    GtB.stride = (size_t)B->cols;
+    GtB.data = workspace;
+
+    return GtB;
+}
+
+
+size_t multiplication_workspace_size(const matrix* A, const matrix* B) {
+    /* Number of doubles of scratch memory multiply_into needs for A * B with the current number of threads */
+
+    matrix G;
+
+    if (A->layout == MATRIX_CSR) { /* every row of the product is calculated on its own */
+        return 0;
+    }
+
+    if (A->layout == MATRIX_LOW_RANK) { /* G^t * B, and the scratch memory to calculate it */
+        G = low_rank_factor(A);
+        return (size_t)A->rank * B->cols + transposed_workspace_size(&G, B);
+    }
+
+    if (A->layout == MATRIX_PACKED) { /* a copy of the result for every thread but the first */
+        return (size_t)(symmetric_threads(A, B) - 1) * A->rows * B->cols;
+    }
+
+    if (A->dtype != MATRIX_FLOAT64) { /* all of B packed as floats */
+        return (gemm_packed_size_float32(B) + 1) / 2;
+    }
+
+    return gemm_workspace_size();
+}
+
+
+void multiply_into(const matrix* A, const matrix* B, matrix* C, double* workspace) {
+    /* Multiply to matrices of size n x r and r x m into a dense n x m matrix C without allocating memory.
+    A may be packed, sparse, low rank or reduced precision, B must be dense, workspace holds
+    multiplication_workspace_size(A, B) doubles */
+
+    matrix G;
+    matrix GtB;
+    int i;
+
+    if (A->layout == MATRIX_LOW_RANK) { /* G * (G^t * B) - diag(c) * B, two skinny products */
+        G = low_rank_factor(A);
+        GtB = factor_product(A, B, workspace);
+        transposed_multiply_into(&G, B, &GtB, workspace + (size_t)A->rank * B->cols);
+
+        #pragma omp parallel for schedule(static) if ((double)A->rows * A->rank * B->cols > PARALLEL_MIN_WORK)
+        for (i = 0; i < A->rows; i++) {
+            low_rank_rows(A, B, &GtB, i, 1, MATRIX_ROW(C, i), C->stride);
+        }
+    }
+    else if (A->layout == MATRIX_CSR) {
+        #pragma omp parallel for schedule(dynamic, 64) if ((double)A->offsets[A->rows] * B->cols > PARALLEL_MIN_WORK)
+        for (i = 0; i < A->rows; i++) {
+            csr_rows(A, B, i, 1, MATRIX_ROW(C, i), C->stride);
+        }
+    }
+    else if (A->layout == MATRIX_PACKED) {
+        symmetric_multiplication(A, B, C, workspace);
+    }
+    else if (A->dtype != MATRIX_FLOAT64) {
+        gemm_pack_float32(B, (float*)workspace);
+
+        #pragma omp parallel for schedule(static) if ((double)A->rows * A->cols * B->cols > PARALLEL_MIN_WORK)
+        for (i = 0; i < A->rows; i += GEMM_MC) {
+            gemm_rows_float32(A, B, (const float*)workspace, i, A->rows - i < GEMM_MC ? A->rows - i : GEMM_MC,
+                              MATRIX_ROW(C, i), C->stride);
+        }
+    }
+    else {
+        gemm_workspace(A, B, C, workspace);
+    }
+}
+
+
+matrix* matrix_multiplication(const matrix* A, const matrix* B) {
+    /* Multiply to matrices of size n x r and r x m, respectivley. A may be packed, sparse, low rank or reduced
+    precision, B must be dense */
+    matrix* C;
+    double* workspace;
+    size_t size;
+
+    /* Allocate memory for matrix and for the scratch memory of the product, and check for errors */
+    C = malloc_matrix(A->rows, B->cols);
+    if (C == NULL) {
+        return NULL;
+    }
+    size = multiplication_workspace_size(A, B);
+    workspace = NULL;
+    if (size > 0 && (workspace = (double*)malloc(size * sizeof(double))) == NULL) {
+        free_matrix(C);
+        return NULL;
+    }
+
+    multiply_into(A, B, C, workspace);
+
+    free(workspace);
+
+    return C;
+}
+
+
+double frobenius_norm(const matrix* A) {
+    /* Frobenius norm squared of a matrix of any layout, reading only the stored cells */
+    const double* row;
+    const double* c;
+    double result, gram;
+    size_t p, cells;
+    int i, j, q;
+
+    /* Sum starts at 0 */
+    result = 0;
+
+    if (A->layout == MATRIX_CSR || A->layout == MATRIX_DIAGONAL) {
+        cells = A->layout == MATRIX_CSR ? A->offsets[A->rows] : (size_t)A->rows;
+        for (p = 0; p < cells; p++) {
+            result += pow(((const double*)A->data)[p], 2);
+        }
+        return result;
+    }
+
+    if (A->layout == MATRIX_LOW_RANK) {
+        /* ||G * G^t - diag(c)||^2 = ||G^t * G||^2 - 2 * sum(c_i * ||g_i||^2) + sum(c_i^2) for g_i the rows of G,
+        G^t * G is only rank x rank and symmetric */
+        for (j = 0; j < A->rank; j++) {
+            for (q = j; q < A->rank; q++) {
+                gram = 0;
+                for (i = 0; i < A->rows; i++) {
+                    gram += MATRIX_AT(A, i, j) * MATRIX_AT(A, i, q);
+                }
+                result += (q == j ? 1 : 2) * gram * gram;
+            }
+        }
+        c = MATRIX_LOW_RANK_DIAGONAL(A);
+        for (i = 0; i < A->rows; i++) {
+            row = MATRIX_ROW(A, i);
+            gram = 0;
+            for (j = 0; j < A->rank; j++) {
+                gram += row[j] * row[j];
+            }
+            result += c[i] * c[i] - 2 * c[i] * gram;
+        }
+        return result;
+    }
+
+    /* Calculate sum of squares of the cells of the given matrix, a packed row holds cell (i, i) once and every
+    other cell for both (i, j) and (j, i) */
+    #pragma omp parallel for private(row, j) reduction(+:result) schedule(static) \
+        if ((double)A->rows * A->cols > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        if (A->layout == MATRIX_PACKED) {
+            row = MATRIX_PACKED_ROW(A, i);
+            result += pow(row[0], 2);
+            for (j = 1; j < A->cols - i; j++) {
+                result += 2 * pow(row[j], 2);
+            }
+        }
+        else if (A->dtype != MATRIX_FLOAT64) {
+            for (j = 0; j < A->cols; j++) {
+                result += pow(matrix_get(A, i, j), 2);
+            }
+        }
+        else {
+            row = MATRIX_ROW(A, i);
+            for (j = 0; j < A->cols; j++) {
+                result += pow(row[j], 2);
+            }
+        }
+    }
+
+    return result;
+}
+
+
+void approximation_error(const matrix* exact, const matrix* approximation, double* max_error, double* relative_error) {
+    /* Compare two n x m matrices of any layout cell by cell: the largest absolute difference, and the frobenius
+    norm of the difference relative to the one of exact */
+
+    double difference, error, norm, largest;
+    int i, j;
+
+    largest = 0;
+    error = 0;
+    norm = 0;
+
+    #pragma omp parallel for private(j, difference) reduction(+:error, norm) reduction(max:largest) \
+        schedule(static) if ((double)exact->rows * exact->cols > PARALLEL_MIN_WORK)
+    for (i = 0; i < exact->rows; i++) {
+        for (j = 0; j < exact->cols; j++) {
+            difference = fabs(matrix_get(exact, i, j) - matrix_get(approximation, i, j));
+            largest = difference > largest ? difference : largest;
+            error += difference * difference;
+            norm += matrix_get(exact, i, j) * matrix_get(exact, i, j);
+        }
+    }
+
+    *max_error = largest;
+    *relative_error = norm > 0 ? sqrt(error / norm) : sqrt(error);
+}
+
+
+double matrix_sum(const matrix* A) {
+    /* Sum of all the cells of a matrix of any layout, reading only the stored ones */
+
+    const double* row;
+    double sum, total;
+    size_t p, cells;
+    int i, j;
+
+    sum = 0;
+
+    if (A->layout == MATRIX_CSR || A->layout == MATRIX_DIAGONAL) {
+        cells = A->layout == MATRIX_CSR ? A->offsets[A->rows] : (size_t)A->rows;
+        for (p = 0; p < cells; p++) {
+            sum += ((const double*)A->data)[p];
+        }
+        return sum;
+    }
+
+    if (A->layout == MATRIX_LOW_RANK) {
+        /* 1^t * G * G^t * 1 - sum(c): the squared norm of the sums of the columns of G, minus the diagonal */
+        for (j = 0; j < A->rank; j++) {
+            total = 0;
+            for (i = 0; i < A->rows; i++) {
+                total += MATRIX_AT(A, i, j);
+            }
+            sum += total * total;
+        }
+        for (i = 0; i < A->rows; i++) {
+            sum -= MATRIX_LOW_RANK_DIAGONAL(A)[i];
+        }
+        return sum;
+    }
+
+    /* A packed row holds cell (i, i) once and every other cell for both (i, j) and (j, i) */
+    #pragma omp parallel for private(row, j) reduction(+:sum) schedule(static) \
+        if ((double)A->rows * A->cols > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        if (A->layout == MATRIX_PACKED) {
+            row = MATRIX_PACKED_ROW(A, i);
+            sum += row[0];
+            for (j = 1; j < A->cols - i; j++) {
+                sum += 2 * row[j];
+            }
+        }
+        else if (A->dtype != MATRIX_FLOAT64) {
+            for (j = 0; j < A->cols; j++) {
+                sum += matrix_get(A, i, j);
+            }
+        }
+        else {
+            row = MATRIX_ROW(A, i);
+            for (j = 0; j < A->cols; j++) {
+                sum += row[j];
+            }
+        }
+    }
+
+    return sum;
+}
@@ -0,0 +1,82 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stddef.h>
+
+/* Alignment in bytes of every matrix buffer (a cache line, enough for any vector load) */
+#define MATRIX_ALIGNMENT 64
+
+/* Element types a matrix buffer can hold, all but MATRIX_FLOAT64 only for dense matrices: a W symnmf reads at a
+half (float32) or a quarter (float16, bfloat16 as unsigned shorts) of the memory traffic */
+typedef enum {
+    MATRIX_FLOAT64,
+    MATRIX_FLOAT32,
+    MATRIX_FLOAT16, /* IEEE half precision: 5 exponent bits, 10 mantissa bits */
+    MATRIX_BFLOAT16 /* the upper half of a float: 8 exponent bits, 7 mantissa bits */
+} matrix_dtype;
+
+/* How the cells of a matrix are laid out in its buffer */
+typedef enum {
+    MATRIX_DENSE, /* every cell, row after row */
+    MATRIX_DIAGONAL, /* only the main diagonal of a square matrix, as a single row */
+    MATRIX_PACKED, /* upper triangle of a symmetric matrix, row i holds cells i to n - 1 */
+    MATRIX_CSR, /* sparse, row i holds cells offsets[i] to offsets[i + 1] - 1 of data, their columns in indices */
+    MATRIX_LOW_RANK /* G * G^t - diag(c) of a rows x rank factor G, data holds G followed by the rows cells of c */
+} matrix_layout;
+
+/* A row-major matrix living in one aligned buffer */
+typedef struct {
+    int rows;
+    int cols;
+    size_t stride; /* number of elements between the starts of two consecutive rows */
+    matrix_dtype dtype;
+    matrix_layout layout;
+    void* data;
+    size_t* offsets; /* MATRIX_CSR only, rows + 1 of them */
+    int* indices; /* MATRIX_CSR only, increasing within every row */
+    int rank; /* MATRIX_LOW_RANK only, columns of the factor */
+    size_t mapped_bytes; /* size of the file mapping data lives in (see storage.h), 0 for a matrix in memory */
+} matrix;
+
+/* Pointer to the first element of row i of a MATRIX_FLOAT64 matrix */
+#define MATRIX_ROW(A, i) ((double*)(A)->data + (size_t)(i) * (A)->stride)
+/* Element (i, j) of a MATRIX_FLOAT64 matrix */
+#define MATRIX_AT(A, i, j) (MATRIX_ROW(A, i)[j])
+/* Pointer to the first element of row i of a MATRIX_FLOAT32 matrix, and its element (i, j) */
+#define MATRIX_ROW_FLOAT32(A, i) ((float*)(A)->data + (size_t)(i) * (A)->stride)
+#define MATRIX_AT_FLOAT32(A, i, j) (MATRIX_ROW_FLOAT32(A, i)[j])
+/* Pointer to cell (i, i) of a MATRIX_PACKED matrix, cell (i, j) for j >= i is at offset j - i */
+#define MATRIX_PACKED_ROW(A, i) \
+    ((double*)(A)->data + (size_t)(i) * (2 * (size_t)(A)->cols - (size_t)(i) + 1) / 2)
+/* The diagonal c subtracted from G * G^t in a MATRIX_LOW_RANK matrix, rows of G are read with MATRIX_ROW */
+#define MATRIX_LOW_RANK_DIAGONAL(A) ((double*)(A)->data + (size_t)(A)->rows * (A)->stride)
+
+matrix* malloc_matrix(int n, int m);
+matrix* malloc_matrix_dtype(int n, int m, matrix_dtype dtype);
+int matrix_dtype_from_name(const char* name, matrix_dtype* dtype);
+matrix* malloc_diagonal(int n);
+matrix* malloc_packed(int n);
+matrix* malloc_csr(int n, int m, size_t nonzeros);
+matrix* malloc_low_rank(int n, int rank);
+matrix* wrap_matrix(double* data, int n, int m, size_t stride);
+void free_matrix(matrix* A);
+double matrix_get(const matrix* A, int i, int j);
+void matrix_set(matrix* A, int i, int j, double value);
+void matrix_row_floats(const matrix* A, int i, int j, int count, float* out);
+matrix submatrix(const matrix* A, int row, int col, int rows, int cols);
+void transpose_into(const matrix* A, matrix* B);
+matrix* transpose(const matrix* A);
+matrix* convert_matrix(const matrix* A, matrix_dtype dtype);
+size_t multiplication_workspace_size(const matrix* A, const matrix* B);
+void csr_rows(const matrix* A, const matrix* B, int row, int rows, double* C, size_t ldc);
+size_t transposed_workspace_size(const matrix* A, const matrix* B);
+void transposed_multiply_into(const matrix* A, const matrix* B, matrix* C, double* workspace);
+matrix low_rank_factor(const matrix* A);
+void low_rank_rows(const matrix* A, const matrix* B, const matrix* GtB, int row, int rows, double* C, size_t ldc);
+void multiply_into(const matrix* A, const matrix* B, matrix* C, double* workspace);
+matrix* matrix_multiplication(const matrix* A, const matrix* B);
+double frobenius_norm(const matrix* A);
+double matrix_sum(const matrix* A);
+void approximation_error(const matrix* exact, const matrix* approximation, double* max_error, double* relative_error);
+
+#endif
@@ -0,0 +1,54 @@
+#include <stdlib.h>
+
+#include "parallel.h"
+
+
+void parallel_set_threads(int threads) {
+    /* Set the number of threads the parallel loops started by the calling thread use. 0 means the default:
+    SYMNMF_NUM_THREADS if it is set, otherwise OMP_NUM_THREADS or every core. The setting belongs to the calling
+    thread only, so concurrent callers (python threads without the GIL) each keep their own */
+
+#ifdef _OPENMP
+    const char* requested;
+
+    if (threads <= 0) {
+        requested = getenv("SYMNMF_NUM_THREADS");
+        threads = requested != NULL ? atoi(requested) : 0;
+    }
+
+    /* What OpenMP would use on its own, worked out again rather than remembered so nothing is shared */
+    if (threads <= 0) {
+        requested = getenv("OMP_NUM_THREADS");
+        threads = requested != NULL ? atoi(requested) : 0;
+    }
+    if (threads <= 0) {
+        threads = omp_get_num_procs();
+    }
+
+    omp_set_num_threads(threads);
+#else
+    (void)threads;
+#endif
+}
+
+
+int parallel_threads(void) {
+    /* Number of threads the next parallel loop of the calling thread will use */
+
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+
+int parallel_thread_id(void) {
+    /* Index of the calling thread inside a parallel loop, from 0 to parallel_threads() - 1 */
+
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Products smaller than this many multiply-adds run on the calling thread only */
+#define PARALLEL_MIN_WORK 100000.0
+
+void parallel_set_threads(int threads);
+int parallel_threads(void);
+int parallel_thread_id(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+import symnmf_module
+import numpy as np
+import sys
+from symnmf import init_H
+
+np.random.seed(1234)
+
+PRECISIONS = ("single", "half", "bfloat16")
+
+
+def generate_data(rng, k):
+	"""
+	Points like the tester draws them: k centers in [-11, 11]^d with standard normal noise around them
+	rng: numpy random generator
+	k: number of centers
+	return: X, the points without duplicates
+	"""
+	dim = rng.integers(2, 10)
+	n = rng.integers(100, 700)
+	centers = rng.uniform(-11, 11, (k, dim))
+	return np.unique(rng.choice(centers, n) + rng.standard_normal((n, dim)), axis=0)
+
+
+def printed_cells(A):
+	"""
+	The cells of a matrix as the CLI prints them
+	A: matrix (float64, float32 or float16)
+	return: list of the "%.4f" texts of the cells
+	"""
+	return symnmf_module.format(A).replace(b"\n", b",").split(b",")
+
+
+def compare(exact, approximation):
+	"""
+	How far a reduced precision result is from the double one
+	exact: the double precision result
+	approximation: the reduced precision result
+	return: largest absolute difference of a cell, fraction of cells printed differently
+	"""
+	exact_cells = printed_cells(exact)
+	approximation_cells = printed_cells(approximation)
+	differing = sum(a != b for a, b in zip(exact_cells, approximation_cells))
+	difference = np.abs(np.asarray(exact) - np.asarray(approximation, dtype=np.float64)).max()
+	return difference, differing / len(exact_cells)
+
+
+def main():
+	"""
+	Compare sym, norm and symnmf in single, half and bfloat16 precision against double precision on random
+	tester-like data. symnmf stores W in the precision and keeps H in doubles.
+	Usage: python3 precision.py [trials (default: 20)]
+	"""
+	trials = int(sys.argv[1]) if len(sys.argv) > 1 else 20
+	rng = np.random.default_rng(1234)
+	worst = {precision: {"sym": [0, 0], "norm": [0, 0], "symnmf": [0, 0]} for precision in PRECISIONS}
+	agreement = {precision: [] for precision in PRECISIONS}
+
+	print("%-9s %5s %3s %12s %8s %12s %8s %12s %8s %8s" % ("precision", "n", "k", "sym err", "printed", "norm err",
+	                                                          "printed", "H err", "printed", "labels"))
+	for _ in range(trials):
+		k = int(rng.integers(2, 11))
+		X = generate_data(rng, k)
+		W = symnmf_module.norm(X)
+		H_0 = init_H(W, k)
+		H = np.asarray(symnmf_module.symnmf(H_0, W))
+
+		for precision in PRECISIONS:
+			results = {}
+			for goal in ("sym", "norm"):
+				function = getattr(symnmf_module, goal)
+				results[goal] = compare(function(X), function(X, precision=precision))
+
+			# The whole reduced precision pipeline against the double one, from the same initial H. The Solver keeps
+			# W on the C side in its precision; bfloat16 has no buffer format and would come back as float64
+			H_reduced = np.asarray(symnmf_module.Solver(X, precision=precision).fit(H_0))
+			results["symnmf"] = compare(H, H_reduced)
+			agreement[precision].append(np.mean(H.argmax(axis=1) == H_reduced.argmax(axis=1)))
+
+			for goal in worst[precision]:
+				worst[precision][goal] = [max(worst[precision][goal][0], results[goal][0]),
+				                          max(worst[precision][goal][1], results[goal][1])]
+			print("%-9s %5d %3d %12.3e %7.3f%% %12.3e %7.3f%% %12.3e %7.3f%% %7.2f%%" % (
+				precision, len(X), k, results["sym"][0], 100 * results["sym"][1], results["norm"][0],
+				100 * results["norm"][1], results["symnmf"][0], 100 * results["symnmf"][1],
+				100 * agreement[precision][-1]))
+
+	for precision in PRECISIONS:
+		errors = worst[precision]
+		print("%-9s worst %12.3e %7.3f%% %12.3e %7.3f%% %12.3e %7.3f%% %7.2f%% (mean labels %.2f%%)" % (
+			precision, errors["sym"][0], 100 * errors["sym"][1], errors["norm"][0], 100 * errors["norm"][1],
+			errors["symnmf"][0], 100 * errors["symnmf"][1], 100 * min(agreement[precision]),
+			100 * np.mean(agreement[precision])))
+
+
+if __name__ == "__main__":
+	main()
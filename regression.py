@@ -0,0 +1,103 @@
+import symnmf_module
+import numpy as np
+import subprocess
+import tempfile
+import sys
+import os
+
+np.random.seed(1234)
+
+
+def run_cli(*args):
+	"""
+	Run the symnmf program
+	args: its arguments
+	return: the completed process, with its output as text
+	"""
+	return subprocess.run(["./symnmf", *args], capture_output=True, text=True)
+
+
+def write_csv(path, X):
+	"""
+	Write points the way the program reads them
+	path: file to write
+	X: the points
+	"""
+	with open(path, "w") as file:
+		file.write("\n".join(",".join("%.4f" % value for value in row) for row in X) + "\n")
+
+
+def test_packed_file_as_points(directory):
+	"""
+	A packed matrix file (a symmetric matrix stored by its upper triangle) has no rows to read as points: the
+	program and the module refuse it as X, and the module still takes it as W
+	directory: folder for the files of the test
+	return: whether the test passed
+	"""
+	X = np.random.rand(50, 3)
+	points = os.path.join(directory, "points.csv")
+	packed = os.path.join(directory, "packed.mat")
+	write_csv(points, X)
+	if run_cli("--packed", "--file", packed, "sym", points).returncode != 0:
+		return False
+
+	for goal in ("sym", "ddg", "norm"):
+		result = run_cli(goal, packed)
+		if result.returncode != 1 or result.stdout != "An Error Has Occurred\n":
+			return False
+
+		try:
+			getattr(symnmf_module, goal)(packed)
+			return False
+		except RuntimeError:
+			pass
+
+	H = np.asarray(symnmf_module.symnmf(np.random.uniform(0, 0.5, (50, 2)), packed))
+	return H.shape == (50, 2) and bool(np.isfinite(H).all())
+
+
+def test_norm_degree_underflow(directory):
+	"""
+	Points 28 apart on a line have neighbor similarities of about 1e-170, so the product of two degrees
+	underflows to 0 while each degree doesn't. norm divides by sqrt(D_i) * sqrt(D_j) and gets the normalized
+	chain; dividing by sqrt(D_i * D_j) (before user-002) printed only zeros
+	directory: folder for the files of the test
+	return: whether the test passed
+	"""
+	X = np.column_stack([28.0 * np.arange(6), np.zeros(6)])
+	points = os.path.join(directory, "far.csv")
+	write_csv(points, X)
+
+	# The same matrix scaled by 1 / exp(-28^2 / 2), normalizing doesn't depend on the scale
+	A = np.eye(6, k=1) + np.eye(6, k=-1)
+	degrees = A.sum(axis=1)
+	expected = A / np.sqrt(np.outer(degrees, degrees))
+
+	result = run_cli("norm", points)
+	if result.returncode != 0:
+		return False
+	printed = np.array([[float(value) for value in line.split(",")] for line in result.stdout.split()])
+
+	return np.abs(printed - expected).max() < 1e-4 and np.abs(np.asarray(symnmf_module.norm(X)) - expected).max() < 1e-12
+
+
+TESTS = [test_packed_file_as_points, test_norm_degree_underflow]
+
+
+def main():
+	"""
+	Run the regression tests of bugs that were fixed, from the folder of the program and the built module.
+	Usage: python3 regression.py
+	"""
+	failed = 0
+	with tempfile.TemporaryDirectory() as directory:
+		for test in TESTS:
+			passed = test(directory)
+			failed += not passed
+			print("%-40s %s" % (test.__name__, "ok" if passed else "FAILED"))
+
+	sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+	main()
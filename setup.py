@@ -1,8 +1,12 @@
 from setuptools import Extension, setup
 
 
-module = Extension("symnmf_module", sources=['symnmf.c', 'symnmfmodule.c'])
+module = Extension("symnmf_module",
+                   sources=['symnmf.c', 'matrix.c', 'gemm.c', 'simd.c', 'parallel.c', 'graph.c',
+                            'spatial.c', 'storage.c', 'csv.c', 'symnmfmodule.c'],
+                   extra_compile_args=['-fopenmp'],
+                   extra_link_args=['-fopenmp'])
 setup(name='symnmf_module',
         version='1.0',
         description='Python wrapper from custom C extension',
-        ext_modules=[module])
\ No newline at end of file
+        ext_modules=[module])
@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+/* Range reduction and polynomial of the vector exp, x = k * ln(2) + r */
+#define EXP_LOG2E 1.4426950408889634
+#define EXP_LN2_HI 6.93147180369123816490e-01 /* low bits are 0, so k * EXP_LN2_HI is exact */
+#define EXP_LN2_LO 1.90821492927058770002e-10
+#define EXP_MIN (-708.0)
+#define EXP_ROUND 6755399441055744.0 /* 1.5 * 2^52, adding it rounds to an integer kept in the low bits */
+
+/* Taylor coefficients 1 / j! of exp, from j = 12 down to j = 2 */
+static const double exp_coefficients[11] = {
+    2.08767569878680989792e-09, 2.50521083854417187751e-08, 2.75573192239858906526e-07,
+    2.75573192239858906526e-06, 2.48015873015873015873e-05, 1.98412698412698412698e-04,
+    1.38888888888888888889e-03, 8.33333333333333333333e-03, 4.16666666666666666667e-02,
+    1.66666666666666666667e-01, 5.00000000000000000000e-01
+};
+
+
+static void squared_distances_scalar(const double* x, const double* XT, size_t ldxt, int d, int count,
+                                     double* out) {
+    /* Squared distances from x to count points, one point at a time */
+    double diff;
+    int j, p;
+
+    for (j = 0; j < count; j++) {
+        out[j] = 0;
+    }
+
+    for (p = 0; p < d; p++) {
+        for (j = 0; j < count; j++) {
+            diff = XT[p * ldxt + j] - x[p];
+            out[j] += diff * diff;
+        }
+    }
+}
+
+
+static void exp_neg_half_scalar(double* v, int count) {
+    /* exp(-v / 2) with libm */
+    int j;
+
+    for (j = 0; j < count; j++) {
+        v[j] = exp(-v[j] / 2);
+    }
+}
+
+
+static void halves_to_floats_scalar(const unsigned short* halves, int count, float* out) {
+    /* Move the exponent and mantissa into place and scale by 2^112 to rebias the exponent, which turns half
+    subnormals into normal floats on the way */
+    unsigned int bits;
+    float value;
+    int j;
+
+    for (j = 0; j < count; j++) {
+        if ((halves[j] & 0x7c00) == 0x7c00) { /* infinity and NaN keep their mantissa */
+            bits = 0x7f800000 | (unsigned int)(halves[j] & 0x3ff) << 13;
+            memcpy(&value, &bits, sizeof(value));
+        }
+        else {
+            bits = (unsigned int)(halves[j] & 0x7fff) << 13;
+            memcpy(&value, &bits, sizeof(value));
+            value *= 5.192296858534828e+33f;
+        }
+        out[j] = (halves[j] & 0x8000) != 0 ? -value : value;
+    }
+}
+
+
+static size_t newlines_scalar(const char* text, size_t start, size_t end, size_t* positions, size_t capacity) {
+    /* '\n' offsets with memchr */
+    const char* found;
+    size_t count;
+
+    count = 0;
+    while (count < capacity && start < end && (found = (const char*)memchr(text + start, '\n', end - start)) != NULL) {
+        positions[count++] = (size_t)(found - text);
+        start = (size_t)(found - text) + 1;
+    }
+
+    return count;
+}
+
+
+#ifdef SIMD_X86
+
+static size_t newlines_sse2(const char* text, size_t start, size_t end, size_t* positions, size_t capacity) {
+    /* '\n' offsets, comparing 16 bytes at a time and walking the bits of the matches */
+    __m128i newline;
+    unsigned int mask;
+    size_t count;
+
+    newline = _mm_set1_epi8('\n');
+    count = 0;
+    for (; start + 16 <= end; start += 16) {
+        mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(text + start)),
+                                                              newline));
+        while (mask != 0) {
+            if (count == capacity) {
+                return count;
+            }
+            positions[count++] = start + (size_t)__builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    if (count < capacity && start < end) {
+        count += newlines_scalar(text, start, end, positions + count, capacity - count);
+    }
+
+    return count;
+}
+
+
+static void squared_distances_sse2(const double* x, const double* XT, size_t ldxt, int d, int count,
+                                   double* out) {
+    /* Squared distances from x to count points, four points at a time in two independent chains */
+    __m128d sum0, sum1, diff0, diff1, coordinate;
+    const double* column;
+    int j, p;
+
+    for (j = 0; j + 4 <= count; j += 4) {
+        sum0 = _mm_setzero_pd();
+        sum1 = _mm_setzero_pd();
+
+        for (p = 0; p < d; p++) {
+            coordinate = _mm_set1_pd(x[p]);
+            column = XT + p * ldxt + j;
+            diff0 = _mm_sub_pd(_mm_loadu_pd(column), coordinate);
+            diff1 = _mm_sub_pd(_mm_loadu_pd(column + 2), coordinate);
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(diff0, diff0));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(diff1, diff1));
+        }
+
+        _mm_storeu_pd(out + j, sum0);
+        _mm_storeu_pd(out + j + 2, sum1);
+    }
+
+    if (j < count) {
+        squared_distances_scalar(x, XT + j, ldxt, d, count - j, out + j);
+    }
+}
+
+
+static __m128d exp_sse2(__m128d x) {
+    /* exp of two values in [EXP_MIN, 0], see exp_neg_half in simd.h for the error bound */
+    __m128d k, r, p, scale;
+    __m128i bits;
+    int c;
+
+    /* k = round(x / ln(2)), its integer value ends up in the low bits of k + EXP_ROUND */
+    k = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(EXP_LOG2E)), _mm_set1_pd(EXP_ROUND));
+    bits = _mm_castpd_si128(k);
+    k = _mm_sub_pd(k, _mm_set1_pd(EXP_ROUND));
+
+    /* r = x - k * ln(2) in two steps to keep it exact */
+    r = _mm_sub_pd(x, _mm_mul_pd(k, _mm_set1_pd(EXP_LN2_HI)));
+    r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(EXP_LN2_LO)));
+
+    /* exp(r) */
+    p = _mm_set1_pd(exp_coefficients[0]);
+    for (c = 1; c < 11; c++) {
+        p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(exp_coefficients[c]));
+    }
+    p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0));
+    p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0));
+
+    /* 2^k, built directly in the exponent field */
+    scale = _mm_castsi128_pd(_mm_slli_epi64(_mm_add_epi64(bits, _mm_set1_epi64x(1023)), 52));
+
+    return _mm_mul_pd(p, scale);
+}
+
+
+static void exp_neg_half_sse2(double* v, int count) {
+    /* exp(-v / 2), two values at a time */
+    __m128d x, underflow;
+    int j;
+
+    for (j = 0; j + 2 <= count; j += 2) {
+        x = _mm_mul_pd(_mm_loadu_pd(v + j), _mm_set1_pd(-0.5));
+        underflow = _mm_cmplt_pd(x, _mm_set1_pd(EXP_MIN));
+        x = _mm_max_pd(x, _mm_set1_pd(EXP_MIN));
+        _mm_storeu_pd(v + j, _mm_andnot_pd(underflow, exp_sse2(x)));
+    }
+
+    exp_neg_half_scalar(v + j, count - j);
+}
+
+
+__attribute__((target("avx2")))
+static size_t newlines_avx2(const char* text, size_t start, size_t end, size_t* positions, size_t capacity) {
+    /* '\n' offsets, comparing 32 bytes at a time. The avx512 kernels use it too, byte compares need avx512bw */
+    __m256i newline;
+    unsigned int mask;
+    size_t count;
+
+    newline = _mm256_set1_epi8('\n');
+    count = 0;
+    for (; start + 32 <= end; start += 32) {
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(text + start)), newline));
+        while (mask != 0) {
+            if (count == capacity) {
+                return count;
+            }
+            positions[count++] = start + (size_t)__builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    if (count < capacity && start < end) {
+        count += newlines_scalar(text, start, end, positions + count, capacity - count);
+    }
+
+    return count;
+}
+
+
+__attribute__((target("avx,f16c")))
+static void halves_to_floats_f16c(const unsigned short* halves, int count, float* out) {
+    /* Eight halves at a time with vcvtph2ps. The avx512 kernels use it too, widening is bound by the loads */
+    int j;
+
+    for (j = 0; j + 8 <= count; j += 8) {
+        _mm256_storeu_ps(out + j, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(halves + j))));
+    }
+
+    halves_to_floats_scalar(halves + j, count - j, out + j);
+}
+
+
+__attribute__((target("avx2")))
+static void squared_distances_avx2(const double* x, const double* XT, size_t ldxt, int d, int count,
+                                   double* out) {
+    /* Squared distances from x to count points, eight points at a time in two independent chains */
+    __m256d sum0, sum1, diff0, diff1, coordinate;
+    const double* column;
+    int j, p;
+
+    for (j = 0; j + 8 <= count; j += 8) {
+        sum0 = _mm256_setzero_pd();
+        sum1 = _mm256_setzero_pd();
+
+        for (p = 0; p < d; p++) {
+            coordinate = _mm256_set1_pd(x[p]);
+            column = XT + p * ldxt + j;
+            diff0 = _mm256_sub_pd(_mm256_loadu_pd(column), coordinate);
+            diff1 = _mm256_sub_pd(_mm256_loadu_pd(column + 4), coordinate);
+            sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(diff0, diff0));
+            sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(diff1, diff1));
+        }
+
+        _mm256_storeu_pd(out + j, sum0);
+        _mm256_storeu_pd(out + j + 4, sum1);
+    }
+
+    if (j < count) {
+        squared_distances_scalar(x, XT + j, ldxt, d, count - j, out + j);
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+static __m256d exp_avx2(__m256d x) {
+    /* exp of four values in [EXP_MIN, 0], see exp_neg_half in simd.h for the error bound */
+    __m256d k, r, p, scale;
+    __m256i bits;
+    int c;
+
+    /* k = round(x / ln(2)), its integer value ends up in the low bits of k + EXP_ROUND */
+    k = _mm256_fmadd_pd(x, _mm256_set1_pd(EXP_LOG2E), _mm256_set1_pd(EXP_ROUND));
+    bits = _mm256_castpd_si256(k);
+    k = _mm256_sub_pd(k, _mm256_set1_pd(EXP_ROUND));
+
+    /* r = x - k * ln(2) in two steps to keep it exact */
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_HI), x);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_LO), r);
+
+    /* exp(r) */
+    p = _mm256_set1_pd(exp_coefficients[0]);
+    for (c = 1; c < 11; c++) {
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coefficients[c]));
+    }
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+
+    /* 2^k, built directly in the exponent field */
+    scale = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52));
+
+    return _mm256_mul_pd(p, scale);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void exp_neg_half_avx2(double* v, int count) {
+    /* exp(-v / 2), four values at a time */
+    __m256d x, underflow;
+    int j;
+
+    for (j = 0; j + 4 <= count; j += 4) {
+        x = _mm256_mul_pd(_mm256_loadu_pd(v + j), _mm256_set1_pd(-0.5));
+        underflow = _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN), _CMP_LT_OQ);
+        x = _mm256_max_pd(x, _mm256_set1_pd(EXP_MIN));
+        _mm256_storeu_pd(v + j, _mm256_andnot_pd(underflow, exp_avx2(x)));
+    }
+
+    exp_neg_half_scalar(v + j, count - j);
+}
+
+
+__attribute__((target("avx512f")))
+static void squared_distances_avx512(const double* x, const double* XT, size_t ldxt, int d, int count,
+                                     double* out) {
+    /* Squared distances from x to count points, eight points at a time, the last ones under a mask */
+    __m512d sum, diff, coordinate;
+    __mmask8 mask;
+    int j, p;
+
+    for (j = 0; j < count; j += 8) {
+        mask = count - j >= 8 ? 0xFF : (__mmask8)((1 << (count - j)) - 1);
+        sum = _mm512_setzero_pd();
+
+        for (p = 0; p < d; p++) {
+            coordinate = _mm512_set1_pd(x[p]);
+            diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, XT + p * ldxt + j), coordinate);
+            sum = _mm512_add_pd(sum, _mm512_mul_pd(diff, diff));
+        }
+
+        _mm512_mask_storeu_pd(out + j, mask, sum);
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void exp_neg_half_avx512(double* v, int count) {
+    /* exp(-v / 2), eight values at a time, the last ones under a mask */
+    __m512d x, k, r, p;
+    __mmask8 mask, underflow;
+    int j, c;
+
+    for (j = 0; j < count; j += 8) {
+        mask = count - j >= 8 ? 0xFF : (__mmask8)((1 << (count - j)) - 1);
+        x = _mm512_mul_pd(_mm512_maskz_loadu_pd(mask, v + j), _mm512_set1_pd(-0.5));
+        underflow = _mm512_cmp_pd_mask(x, _mm512_set1_pd(EXP_MIN), _CMP_LT_OQ);
+        x = _mm512_max_pd(x, _mm512_set1_pd(EXP_MIN));
+
+        /* k = round(x / ln(2)), r = x - k * ln(2) in two steps to keep it exact */
+        k = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT);
+        r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXP_LN2_HI), x);
+        r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXP_LN2_LO), r);
+
+        /* exp(r) */
+        p = _mm512_set1_pd(exp_coefficients[0]);
+        for (c = 1; c < 11; c++) {
+            p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coefficients[c]));
+        }
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+
+        /* exp(r) * 2^k, underflowing values set to 0 */
+        _mm512_mask_storeu_pd(v + j, mask, _mm512_maskz_scalef_pd((__mmask8)~underflow, p, k));
+    }
+}
+
+#endif
+
+
+static const simd_kernels scalar_kernels = {"scalar", squared_distances_scalar, exp_neg_half_scalar, newlines_scalar,
+                                            halves_to_floats_scalar};
+#ifdef SIMD_X86
+static const simd_kernels sse2_kernels = {"sse2", squared_distances_sse2, exp_neg_half_sse2, newlines_sse2,
+                                          halves_to_floats_scalar};
+static const simd_kernels avx2_kernels = {"avx2", squared_distances_avx2, exp_neg_half_avx2, newlines_avx2,
+                                          halves_to_floats_f16c};
+static const simd_kernels avx512_kernels = {"avx512", squared_distances_avx512, exp_neg_half_avx512, newlines_avx2,
+                                            halves_to_floats_f16c};
+#endif
+
+
+const simd_kernels* simd_find(const char* name) {
+    /* The kernels of the given instruction set ("scalar", "sse2", "avx2" or "avx512"), NULL if this CPU
+    doesn't support it */
+
+    if (strcmp(name, "scalar") == 0) {
+        return &scalar_kernels;
+    }
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+
+    if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c")) {
+        return &avx512_kernels;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+        __builtin_cpu_supports("f16c")) {
+        return &avx2_kernels;
+    }
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        return &sse2_kernels;
+    }
+#endif
+
+    return NULL;
+}
+
+
+static const simd_kernels* detect_kernels(void) {
+    /* The kernels named by SYMNMF_SIMD if it is set and supported, otherwise the widest this CPU supports */
+    const char* names[] = {"avx512", "avx2", "sse2"};
+    const char* requested;
+    const simd_kernels* kernels;
+    unsigned int i;
+
+    requested = getenv("SYMNMF_SIMD");
+    if (requested != NULL && (kernels = simd_find(requested)) != NULL) {
+        return kernels;
+    }
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((kernels = simd_find(names[i])) != NULL) {
+            return kernels;
+        }
+    }
+
+    return &scalar_kernels;
+}
+
+
+const simd_kernels* simd_select(void) {
+    /* Kernels picked once per process by CPUID */
+    static const simd_kernels* selected = NULL;
+
+    if (selected == NULL) {
+        selected = detect_kernels();
+    }
+
+    return selected;
+}
@@ -0,0 +1,31 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+
+/* Vector kernels of the similarity computation, one implementation per instruction set */
+typedef struct {
+    const char* name;
+
+    /* out[j] = ||x - X_j||^2 for count points stored column by column: coordinate p of point j is
+    XT[p * ldxt + j]. Every implementation sums over the coordinates in the same order as the scalar loop */
+    void (*squared_distances)(const double* x, const double* XT, size_t ldxt, int d, int count, double* out);
+
+    /* v[j] = exp(-v[j] / 2) for v[j] >= 0. The vector versions reduce to 2^k * exp(r) with |r| <= ln(2) / 2
+    and evaluate exp(r) with a degree 12 polynomial; their relative error is below 1e-15 (about 5 ulp).
+    Results under exp(-708) (~3e-308) are flushed to 0. The scalar version calls exp from libm */
+    void (*exp_neg_half)(double* v, int count);
+
+    /* Offsets of the '\n' bytes of text[start..end - 1], written to positions in order. Stops once capacity of
+    them are found and returns how many were, a scan that ran out of room resumes after the last one */
+    size_t (*newlines)(const char* text, size_t start, size_t end, size_t* positions, size_t capacity);
+
+    /* out[j] = halves[j] widened exactly from IEEE half precision, infinities and NaNs included. The scalar
+    version (of the scalar and sse2 kernels) works on the bits, the others use the F16C conversion */
+    void (*halves_to_floats)(const unsigned short* halves, int count, float* out);
+} simd_kernels;
+
+const simd_kernels* simd_find(const char* name);
+const simd_kernels* simd_select(void);
+
+#endif
\ No newline at end of file
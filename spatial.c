@@ -0,0 +1,377 @@
+#include <stdlib.h>
+
+#include "spatial.h"
+
+
+static int closer(const neighbor* a, const neighbor* b) {
+    /* Whether a comes before b among the neighbors of a point, equal distances are ordered by index so the
+    result doesn't depend on the order the points are visited in */
+
+    return a->distance < b->distance || (a->distance == b->distance && a->index < b->index);
+}
+
+
+void neighbor_offer(neighbor* heap, int* size, int capacity, neighbor candidate) {
+    /* Keep the capacity closest candidates seen so far in a max-heap, the farthest of them at the root */
+
+    neighbor swap;
+    int i, child;
+
+    if (*size < capacity) { /* room left, sift the candidate up from the bottom */
+        i = (*size)++;
+        heap[i] = candidate;
+
+        while (i > 0 && closer(&heap[(i - 1) / 2], &heap[i])) {
+            swap = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = swap;
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+
+    if (capacity == 0 || !closer(&candidate, &heap[0])) {
+        return;
+    }
+
+    /* Replace the farthest one and sift the candidate down */
+    i = 0;
+    heap[0] = candidate;
+    while ((child = 2 * i + 1) < capacity) {
+        if (child + 1 < capacity && closer(&heap[child], &heap[child + 1])) {
+            child++;
+        }
+        if (!closer(&heap[i], &heap[child])) {
+            break;
+        }
+
+        swap = heap[i];
+        heap[i] = heap[child];
+        heap[child] = swap;
+        i = child;
+    }
+}
+
+
+int neighbor_list_append(neighbor_list* list, neighbor item) {
+    /* Add a neighbor at the end of a list, doubling its capacity when it is full. Returns 0, or -1 if there
+    isn't enough memory, the list is left as it was */
+
+    neighbor* items;
+    size_t capacity;
+
+    if (list->count == list->capacity) {
+        capacity = list->capacity > 0 ? 2 * list->capacity : 64;
+        items = (neighbor*)realloc(list->items, capacity * sizeof(neighbor));
+        if (items == NULL) {
+            return -1;
+        }
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = item;
+
+    return 0;
+}
+
+
+static double squared_distance(const double* x, const double* y, int d) {
+    /* ||x - y||^2, summed in the order of the similarity kernels */
+
+    double sum, difference;
+    int p;
+
+    sum = 0;
+    for (p = 0; p < d; p++) {
+        difference = x[p] - y[p];
+        sum += difference * difference;
+    }
+
+    return sum;
+}
+
+
+static double box_distance(const kdtree* tree, int node, const double* x) {
+    /* Squared distance from x to the closest point of the bounding box of a node, 0 inside it */
+
+    const double* low;
+    const double* high;
+    double sum, difference;
+    int p;
+
+    low = tree->bounds + (size_t)node * 2 * tree->dims;
+    high = low + tree->dims;
+
+    sum = 0;
+    for (p = 0; p < tree->dims; p++) {
+        difference = x[p] < low[p] ? low[p] - x[p] : (x[p] > high[p] ? x[p] - high[p] : 0);
+        sum += difference * difference;
+    }
+
+    return sum;
+}
+
+
+static void select_median(const matrix* X, int* order, int start, int end, int middle, int dim) {
+    /* Reorder order[start..end - 1] so order[middle] is the point it would hold sorted by coordinate dim,
+    with no larger coordinate before it and no smaller one after it (quickselect) */
+
+    double pivot;
+    int swap;
+    int low, high;
+
+    while (end - start > 1) {
+        pivot = MATRIX_AT(X, order[start + (end - start) / 2], dim);
+
+        /* Hoare partition around the pivot */
+        low = start;
+        high = end - 1;
+        while (low <= high) {
+            while (MATRIX_AT(X, order[low], dim) < pivot) {
+                low++;
+            }
+            while (MATRIX_AT(X, order[high], dim) > pivot) {
+                high--;
+            }
+            if (low <= high) {
+                swap = order[low];
+                order[low] = order[high];
+                order[high] = swap;
+                low++;
+                high--;
+            }
+        }
+
+        /* Continue in the part that holds middle, done once it lands between the two */
+        if (middle <= high) {
+            end = high + 1;
+        }
+        else if (middle >= low) {
+            start = low;
+        }
+        else {
+            return;
+        }
+    }
+}
+
+
+static int build_node(kdtree* tree, const matrix* X, int start, int end, int* count) {
+    /* Build the subtree of the points start to end - 1 of the tree order and return the index of its root.
+    Nodes are split at the median of their widest dimension until they hold at most KDTREE_LEAF points */
+
+    kdtree_node* node;
+    double* low;
+    double* high;
+    double value;
+    int index, dim, i, p;
+
+    index = (*count)++;
+    node = &tree->nodes[index];
+    node->start = start;
+    node->end = end;
+    node->left = -1;
+    node->right = -1;
+
+    /* Bounding box of the points of the node */
+    low = tree->bounds + (size_t)index * 2 * tree->dims;
+    high = low + tree->dims;
+    for (p = 0; p < tree->dims; p++) {
+        low[p] = high[p] = MATRIX_AT(X, tree->order[start], p);
+    }
+    for (i = start + 1; i < end; i++) {
+        for (p = 0; p < tree->dims; p++) {
+            value = MATRIX_AT(X, tree->order[i], p);
+            low[p] = value < low[p] ? value : low[p];
+            high[p] = value > high[p] ? value : high[p];
+        }
+    }
+
+    if (end - start <= KDTREE_LEAF) {
+        return index;
+    }
+
+    /* Split the widest dimension at its median */
+    dim = 0;
+    for (p = 1; p < tree->dims; p++) {
+        if (high[p] - low[p] > high[dim] - low[dim]) {
+            dim = p;
+        }
+    }
+    select_median(X, tree->order, start, end, start + (end - start) / 2, dim);
+
+    node->left = build_node(tree, X, start, start + (end - start) / 2, count);
+    node->right = build_node(tree, X, start + (end - start) / 2, end, count);
+
+    return index;
+}
+
+
+kdtree* kdtree_build(const matrix* X) {
+    /* Build a kd-tree over the rows of a dense matrix. The tree keeps its own copy of the points. Returns NULL
+    if there isn't enough memory */
+
+    kdtree* tree;
+    size_t max_nodes;
+    int n, i, p;
+
+    n = X->rows;
+
+    /* Every split leaves at least KDTREE_LEAF / 2 points on both sides, which bounds the number of leaves */
+    max_nodes = 2 * ((size_t)n / (KDTREE_LEAF / 2) + 1);
+
+    /* Allocate the tree and check for errors */
+    tree = (kdtree*)malloc(sizeof(kdtree));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->dims = X->cols;
+    tree->order = (int*)malloc(((size_t)n + 1) * sizeof(int));
+    tree->nodes = (kdtree_node*)malloc(max_nodes * sizeof(kdtree_node));
+    tree->bounds = (double*)malloc((max_nodes * 2 * X->cols + 1) * sizeof(double));
+    tree->points = malloc_matrix(n, X->cols);
+    if (tree->order == NULL || tree->nodes == NULL || tree->bounds == NULL || tree->points == NULL) {
+        kdtree_free(tree);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        tree->order[i] = i;
+    }
+
+    /* An empty tree is a single leaf without points */
+    tree->nodes[0].start = 0;
+    tree->nodes[0].end = 0;
+    tree->nodes[0].left = -1;
+    tree->nodes[0].right = -1;
+
+    if (n > 0) {
+        i = 0;
+        build_node(tree, X, 0, n, &i);
+    }
+
+    /* Copy the points in tree order */
+    for (i = 0; i < n; i++) {
+        for (p = 0; p < X->cols; p++) {
+            MATRIX_AT(tree->points, i, p) = MATRIX_AT(X, tree->order[i], p);
+        }
+    }
+
+    return tree;
+}
+
+
+void kdtree_free(kdtree* tree) {
+    /* Free all memory used by a kd-tree */
+
+    free(tree->order);
+    free(tree->nodes);
+    free(tree->bounds);
+    free_matrix(tree->points);
+    free(tree);
+}
+
+
+static void knn_search(const kdtree* tree, int index, const double* x, int exclude, int knn, neighbor* heap,
+                       int* size) {
+    /* Offer the points of a subtree to the heap of the knn closest, skipping subtrees that can't hold a
+    point closer than the farthest one kept */
+
+    const kdtree_node* node;
+    neighbor candidate;
+    double left, right;
+    int i;
+
+    node = &tree->nodes[index];
+
+    if (node->left < 0) {
+        for (i = node->start; i < node->end; i++) {
+            if (tree->order[i] != exclude) {
+                candidate.index = tree->order[i];
+                candidate.distance = squared_distance(x, MATRIX_ROW(tree->points, i), tree->dims);
+                neighbor_offer(heap, size, knn, candidate);
+            }
+        }
+        return;
+    }
+
+    /* Nearer child first, it shrinks the heap radius the most */
+    left = box_distance(tree, node->left, x);
+    right = box_distance(tree, node->right, x);
+
+    if (left <= right) {
+        if (*size < knn || left <= heap[0].distance) {
+            knn_search(tree, node->left, x, exclude, knn, heap, size);
+        }
+        if (*size < knn || right <= heap[0].distance) {
+            knn_search(tree, node->right, x, exclude, knn, heap, size);
+        }
+    }
+    else {
+        if (*size < knn || right <= heap[0].distance) {
+            knn_search(tree, node->right, x, exclude, knn, heap, size);
+        }
+        if (*size < knn || left <= heap[0].distance) {
+            knn_search(tree, node->left, x, exclude, knn, heap, size);
+        }
+    }
+}
+
+
+int kdtree_knn(const kdtree* tree, const double* x, int exclude, int knn, neighbor* heap) {
+    /* Find the knn points closest to x, leaving out the row exclude (-1 for none). They are stored in heap
+    as a max-heap, and their number (less than knn only if the tree is that small) is returned */
+
+    int size;
+
+    size = 0;
+    knn_search(tree, 0, x, exclude, knn, heap, &size);
+
+    return size;
+}
+
+
+static int radius_search(const kdtree* tree, int index, const double* x, int exclude, double squared_radius,
+                         neighbor_list* result) {
+    /* Append the points of a subtree within the radius to the result, -1 if the result can't grow */
+
+    const kdtree_node* node;
+    neighbor candidate;
+    int i;
+
+    if (box_distance(tree, index, x) > squared_radius) {
+        return 0;
+    }
+
+    node = &tree->nodes[index];
+
+    if (node->left < 0) {
+        for (i = node->start; i < node->end; i++) {
+            candidate.index = tree->order[i];
+            candidate.distance = squared_distance(x, MATRIX_ROW(tree->points, i), tree->dims);
+
+            if (candidate.index != exclude && candidate.distance <= squared_radius &&
+                neighbor_list_append(result, candidate) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (radius_search(tree, node->left, x, exclude, squared_radius, result) != 0) {
+        return -1;
+    }
+    return radius_search(tree, node->right, x, exclude, squared_radius, result);
+}
+
+
+int kdtree_radius(const kdtree* tree, const double* x, int exclude, double squared_radius,
+                   neighbor_list* result) {
+    /* Append every point whose squared distance to x is at most squared_radius to the result, leaving out
+    the row exclude (-1 for none). The points come in tree order. Returns 0, or -1 if there isn't enough
+    memory for the result */
+
+    return radius_search(tree, 0, x, exclude, squared_radius, result);
+}
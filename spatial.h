@@ -0,0 +1,49 @@
+#ifndef SPATIAL_H
+#define SPATIAL_H
+
+#include <stddef.h>
+
+#include "matrix.h"
+
+/* Points per leaf of the kd-tree, and the dimension up to which searching it beats comparing with every point */
+#define KDTREE_LEAF 16
+#define KDTREE_MAX_DIM 16
+
+/* A point of X seen from another one: its row in X and its squared distance */
+typedef struct {
+    int index;
+    double distance;
+} neighbor;
+
+/* A growing array of neighbors */
+typedef struct {
+    neighbor* items;
+    size_t count;
+    size_t capacity;
+} neighbor_list;
+
+/* A node of the kd-tree, holding the points start to end - 1 in tree order. Leaves have no children (-1) */
+typedef struct {
+    int start;
+    int end;
+    int left;
+    int right;
+} kdtree_node;
+
+/* A kd-tree over the rows of a matrix. Queries don't change it, so any number of threads can share one */
+typedef struct {
+    int dims;
+    int* order; /* row in X of every point in tree order */
+    matrix* points; /* the points in tree order, so a leaf is read contiguously */
+    kdtree_node* nodes; /* nodes[0] is the root */
+    double* bounds; /* bounding box of every node: 2 * dims cells, the low corner then the high one */
+} kdtree;
+
+void neighbor_offer(neighbor* heap, int* size, int capacity, neighbor candidate);
+int neighbor_list_append(neighbor_list* list, neighbor item);
+kdtree* kdtree_build(const matrix* X);
+void kdtree_free(kdtree* tree);
+int kdtree_knn(const kdtree* tree, const double* x, int exclude, int knn, neighbor* heap);
+int kdtree_radius(const kdtree* tree, const double* x, int exclude, double squared_radius, neighbor_list* result);
+
+#endif
@@ -0,0 +1,234 @@
+/* madvise, posix_madvise can't release pages on Linux */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+
+
+static size_t file_cells(int n, int m, matrix_layout layout) {
+    /* Number of cells a matrix file of the given size and layout holds */
+
+    if (layout == MATRIX_PACKED) {
+        return (size_t)n * ((size_t)n + 1) / 2;
+    }
+
+    return (size_t)n * m;
+}
+
+
+static matrix* map_file(int file, size_t bytes, int writable, const matrix_file_header* header) {
+    /* Map an open matrix file and build the header of the matrix living in it */
+
+    matrix* A;
+    char* mapping;
+
+    /* The mapping is all that is needed, the file can be closed either way */
+    mapping = (char*)mmap(NULL, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* Whole passes over the matrix are the rule, let the kernel read ahead */
+    madvise(mapping, bytes, MADV_SEQUENTIAL);
+
+    A = (matrix*)malloc(sizeof(matrix));
+    if (A == NULL) {
+        munmap(mapping, bytes);
+        return NULL;
+    }
+
+    A->rows = (int)header->rows;
+    A->cols = (int)header->cols;
+    A->dtype = MATRIX_FLOAT64;
+    A->layout = (matrix_layout)header->layout;
+    A->stride = A->layout == MATRIX_PACKED ? 0 : (size_t)A->cols;
+    A->data = mapping + MATRIX_FILE_HEADER;
+    A->offsets = NULL;
+    A->indices = NULL;
+    A->rank = 0;
+    A->mapped_bytes = bytes;
+
+    return A;
+}
+
+
+matrix* create_matrix_file(const char* path, int n, int m, matrix_layout layout) {
+    /* Create (or replace) a matrix file of size n x m, dense or packed, and map it for writing. The cells
+    start at 0 and reach the file as the kernel writes the pages back, so the matrix can be larger than memory.
+    Returns NULL if the file can't be created */
+
+    matrix_file_header header;
+    char page[MATRIX_FILE_HEADER];
+    size_t bytes;
+    int file;
+
+    if (layout != MATRIX_DENSE && layout != MATRIX_PACKED) {
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.byte_order = MATRIX_FILE_BYTE_ORDER;
+    header.dtype = MATRIX_FLOAT64;
+    header.layout = layout;
+    header.rows = (unsigned int)n;
+    header.cols = (unsigned int)m;
+
+    memset(page, 0, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+
+    /* Write the header page, then grow the file to its full size without writing the cells */
+    bytes = MATRIX_FILE_HEADER + file_cells(n, m, layout) * sizeof(double);
+    file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        return NULL;
+    }
+    if (write(file, page, sizeof(page)) != (ssize_t)sizeof(page) || ftruncate(file, (off_t)bytes) != 0) {
+        close(file);
+        return NULL;
+    }
+
+    return map_file(file, bytes, 1, &header);
+}
+
+
+matrix* map_matrix_file(const char* path) {
+    /* Map an existing matrix file for reading. Returns NULL if it can't be read or isn't a usable matrix file */
+
+    matrix_file_header header;
+    struct stat status;
+    size_t cells, bytes;
+    int file;
+
+    /* Read the header and check it belongs to a matrix file this machine can use as is */
+    file = open(path, O_RDONLY);
+    if (file < 0) {
+        return NULL;
+    }
+    if (read(file, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.byte_order != MATRIX_FILE_BYTE_ORDER || header.dtype != MATRIX_FLOAT64 ||
+        (header.layout != MATRIX_DENSE && header.layout != MATRIX_PACKED) ||
+        header.rows > INT_MAX || header.cols > INT_MAX ||
+        (header.layout == MATRIX_PACKED && header.rows != header.cols)) {
+        close(file);
+        return NULL;
+    }
+
+    /* The file must hold all the cells its header promises */
+    cells = file_cells((int)header.rows, (int)header.cols, (matrix_layout)header.layout);
+    bytes = MATRIX_FILE_HEADER + cells * sizeof(double);
+    if (cells > ((size_t)-1 - MATRIX_FILE_HEADER) / sizeof(double) || fstat(file, &status) != 0 ||
+        (size_t)status.st_size < bytes) {
+        close(file);
+        return NULL;
+    }
+
+    return map_file(file, bytes, 0, &header);
+}
+
+
+int is_matrix_file(const char* path) {
+    /* Whether a file starts like a matrix file, anything else is read as CSV. Only a regular file can be one,
+    peeking into a pipe would take its first bytes away from the CSV reader */
+
+    char magic[sizeof(MATRIX_FILE_MAGIC) - 1];
+    struct stat status;
+    FILE* file;
+    int found;
+
+    if (stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+        return 0;
+    }
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    found = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+        memcmp(magic, MATRIX_FILE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+
+    return found;
+}
+
+
+int write_matrix_file(const matrix* A, const char* path) {
+    /* Write a dense matrix to a matrix file, which can then be mapped instead of parsed. Returns 0, or -1 if
+    the file can't be created */
+
+    matrix* file;
+    int i;
+
+    file = create_matrix_file(path, A->rows, A->cols, MATRIX_DENSE);
+    if (file == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < A->rows; i++) {
+        memcpy(MATRIX_ROW(file, i), MATRIX_ROW(A, i), (size_t)A->cols * sizeof(double));
+    }
+
+    free_matrix(file);
+
+    return 0;
+}
+
+
+void advise_rows(const matrix* A, int row, int rows, matrix_advice advice) {
+    /* Tell the kernel the rows row to row + rows - 1 of a mapped matrix are about to be read, or won't be read
+    again soon. Does nothing for a matrix in memory */
+
+    const char* start;
+    const char* end;
+    size_t page;
+
+    if (row + rows > A->rows) {
+        rows = A->rows - row;
+    }
+
+    if (A->mapped_bytes == 0 || rows <= 0) {
+        return;
+    }
+
+    if (A->layout == MATRIX_PACKED) {
+        start = (const char*)MATRIX_PACKED_ROW(A, row);
+        end = (const char*)MATRIX_PACKED_ROW(A, row + rows);
+    }
+    else {
+        start = (const char*)MATRIX_ROW(A, row);
+        end = (const char*)MATRIX_ROW(A, row + rows);
+    }
+
+    /* Advice is given on whole pages, releasing only the ones entirely inside the range. Released pages of a
+    shared mapping stay in the file (and the page cache), reading them again only faults them back in */
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    if (advice == MATRIX_WILLNEED) {
+        start -= (size_t)start % page;
+        madvise((void*)start, (size_t)(end - start), MADV_WILLNEED);
+    }
+    else {
+        start += (page - (size_t)start % page) % page;
+        end -= (size_t)end % page;
+        if (end > start) {
+            madvise((void*)start, (size_t)(end - start), MADV_DONTNEED);
+        }
+    }
+}
+
+
+void unmap_matrix(matrix* A) {
+    /* Unmap the file of a mapped matrix, what was written stays in the file */
+
+    munmap((char*)A->data - MATRIX_FILE_HEADER, A->mapped_bytes);
+}
@@ -0,0 +1,40 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "matrix.h"
+
+/* A matrix file is a header page followed by the cells exactly as they are laid out in memory (dense rows
+without padding, or the packed upper triangle), so using a file is only mapping it */
+#define MATRIX_FILE_MAGIC "SYMNMFMX"
+#define MATRIX_FILE_HEADER 4096
+/* Written as a number by the machine that wrote the file, reads back differently on the other byte order */
+#define MATRIX_FILE_BYTE_ORDER 0x01020304U
+
+/* Rows of a mapped matrix streamed together: the next panel is prefetched while one is used, and a used one
+is released, so only a few panels are ever in memory */
+#define MATRIX_PANEL_ROWS 256
+
+/* What is known to come next for a range of rows of a mapped matrix */
+typedef enum {
+    MATRIX_WILLNEED,
+    MATRIX_DONTNEED
+} matrix_advice;
+
+/* The header page of a matrix file */
+typedef struct {
+    char magic[8];
+    unsigned int byte_order;
+    unsigned int dtype;
+    unsigned int layout;
+    unsigned int rows;
+    unsigned int cols;
+} matrix_file_header;
+
+matrix* create_matrix_file(const char* path, int n, int m, matrix_layout layout);
+matrix* map_matrix_file(const char* path);
+int is_matrix_file(const char* path);
+int write_matrix_file(const matrix* A, const char* path);
+void advise_rows(const matrix* A, int row, int rows, matrix_advice advice);
+void unmap_matrix(matrix* A);
+
+#endif
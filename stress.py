@@ -0,0 +1,75 @@
+import symnmf_module
+import numpy as np
+import threading
+import time
+import sys
+import os
+
+np.random.seed(1234)
+
+
+def job(X, H):
+	"""
+	A clustering job on a single core: the normalized similarity matrix and its factorization
+	X: input matrix
+	H: initial H
+	return: the optimized H
+	"""
+	W = symnmf_module.norm(X, threads=1)
+	return np.asarray(symnmf_module.symnmf(H, W, threads=1))
+
+
+def run_concurrently(X, H, jobs):
+	"""
+	Run the jobs in python threads at the same time, the module releases the GIL while it calculates
+	X: input matrix
+	H: initial H
+	jobs: number of threads
+	return: the result of every thread
+	"""
+	results = [None] * jobs
+
+	def worker(i):
+		results[i] = job(X, H)
+
+	threads = [threading.Thread(target=worker, args=(i,)) for i in range(jobs)]
+	for thread in threads:
+		thread.start()
+	for thread in threads:
+		thread.join()
+
+	return results
+
+
+def main():
+	"""
+	Time N jobs one after another and N jobs in N threads, and check the threads got the same results.
+	Usage: python3 stress.py [N (default: every core)] [points (default: 2000)]
+	"""
+	jobs = int(sys.argv[1]) if len(sys.argv) > 1 else os.cpu_count()
+	n = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+	k = 5
+
+	X = np.random.rand(n, 8)
+	H = np.random.uniform(0, 0.5, (n, k))
+	expected = job(X, H)
+
+	start = time.perf_counter()
+	for _ in range(jobs):
+		job(X, H)
+	sequential = time.perf_counter() - start
+
+	start = time.perf_counter()
+	results = run_concurrently(X, H, jobs)
+	concurrent = time.perf_counter() - start
+
+	if any(not np.array_equal(result, expected) for result in results):
+		print("An Error Has Occurred")
+		sys.exit(1)
+
+	print("%d jobs of %d points on %d cores" % (jobs, n, os.cpu_count()))
+	print("sequential %.3fs, concurrent %.3fs, speedup %.2f" % (sequential, concurrent, sequential / concurrent))
+
+
+if __name__ == "__main__":
+	main()
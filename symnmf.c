@@ -2,8 +2,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
 
 #include "symnmf.h"
+#include "graph.h"
+#include "simd.h"
+#include "gemm.h"
+#include "parallel.h"
+#include "storage.h"
+#include "csv.h"
 
 
 const double EPSILON = 1e-4;
@@ -12,396 +19,1270 @@ const double DENOMINATOR_EPSILON = 1e-6;
 const double BETA = 0.5;
 
 
-double** malloc_matrix(int n, int m) {
-    /* Allocate memory for a n * m matrix of doubles */
+/* Rows of the similarity matrix calculated together, and the dimension from which the Gram method pays off */
+#define SIMILARITY_BLOCK 64
+#define GRAM_MIN_DIM 160
+#define GRAM_MIN_POINTS 256
+/* Up to this many points the CLI checks a Nystrom approximation against the exact matrix, which takes O(n^2) */
+#define NYSTROM_REPORT_MAX_POINTS 5000
+/* Rows of H updated together by a thread in symnmf_c, the tile of W * H they need stays in L1/L2 */
+#define SYMNMF_BLOCK GEMM_MC
 
-    double** A;
-    int i;
 
-    /* Allocate memory for an array of pointers to the cells and check for errors */
-    A = (double**)malloc(n * sizeof(double*));
-    if (A == NULL) {
-        printf("An Error Has Occurred\n");
-        exit(1);
+/* Everything needed to calculate the similarity matrix block by block, shared by all threads */
+typedef struct {
+    const matrix* X;
+    matrix* XT; /* X transposed for the direct kernel, centered X transposed for the Gram method */
+    matrix* centered; /* X minus its mean, Gram method only */
+    double* norms; /* squared norms of the centered points, Gram method only */
+    const simd_kernels* kernels;
+} similarity_engine;
+
+
+static int use_gram_method(int n, int d) {
+    /* Whether squared distances should come from ||xi||^2 + ||xj||^2 - 2 * <xi, xj> with the blocked GEMM
+    instead of the direct kernel. SYMNMF_DISTANCE=direct|gram overrides the automatic choice */
+
+    const char* requested;
+
+    requested = getenv("SYMNMF_DISTANCE");
+    if (requested != NULL && strcmp(requested, "direct") == 0) {
+        return 0;
+    }
+    if (requested != NULL && strcmp(requested, "gram") == 0) {
+        return 1;
     }
 
-    /* Allocate the memory line by line */
-    for (i = 0; i < n; i++) {
-        A[i] = (double*)malloc(m * sizeof(double));
-        if (A[i] == NULL) {
-            printf("An Error Has Occurred\n");
-            exit(1);
+    /* The direct kernel is compute bound on the vector units for small d, and only starts waiting on
+    memory once X no longer fits in L2. Measured with 3000 points: direct wins up to d = 128, Gram from
+    d = 256 on (1.6x faster) */
+    return d >= GRAM_MIN_DIM && n >= GRAM_MIN_POINTS;
+}
+
+
+static int engine_init(similarity_engine* engine, const matrix* X) {
+    /* Prepare the layouts the chosen distance method reads. Returns 0, or -1 if there isn't enough memory,
+    engine_free then frees what was prepared */
+
+    double* mean;
+    double* row;
+    int i, p;
+
+    engine->X = X;
+    engine->kernels = simd_select();
+    engine->centered = NULL;
+    engine->norms = NULL;
+
+    engine->XT = NULL;
+
+    if (!use_gram_method(X->rows, X->cols)) {
+        engine->XT = transpose(X);
+        return engine->XT == NULL ? -1 : 0;
+    }
+
+    /* Distances don't change when the points are moved, and centering them keeps the norms small so
+    subtracting 2 * <xi, xj> from them loses less precision */
+    mean = (double*)calloc(X->cols, sizeof(double));
+    engine->norms = (double*)malloc(X->rows * sizeof(double));
+    engine->centered = malloc_matrix(X->rows, X->cols);
+    if (mean == NULL || engine->norms == NULL || engine->centered == NULL) {
+        free(mean);
+        return -1;
+    }
+
+    for (i = 0; i < X->rows; i++) {
+        for (p = 0; p < X->cols; p++) {
+            mean[p] += MATRIX_AT(X, i, p);
         }
     }
 
-    return A;
+    for (i = 0; i < X->rows; i++) {
+        row = MATRIX_ROW(engine->centered, i);
+        engine->norms[i] = 0;
+
+        for (p = 0; p < X->cols; p++) {
+            row[p] = MATRIX_AT(X, i, p) - mean[p] / X->rows;
+            engine->norms[i] += row[p] * row[p];
+        }
+    }
+
+    engine->XT = transpose(engine->centered);
+
+    free(mean);
+
+    return engine->XT == NULL ? -1 : 0;
 }
 
 
-void free_matrix(double** A, int n) {
-    /* Free all memory used by a matrix */
-    
-    int i;
+static void engine_free(similarity_engine* engine) {
+    /* Free the memory of an engine */
 
-    /* Go through every line and free its memory */
-    for (i = 0; i < n; i++) {
-        free(A[i]);
+    free_matrix(engine->XT);
+    free_matrix(engine->centered);
+    free(engine->norms);
+}
+
+
+static int engine_scratch(const similarity_engine* engine, matrix** G, double** workspace) {
+    /* The per thread buffers for a block of rows of centered X * centered X^t and the packing of the GEMM,
+    both NULL for the direct kernel. Returns 0, or -1 if there isn't enough memory for them */
+
+    *G = NULL;
+    *workspace = NULL;
+
+    if (engine->centered == NULL) {
+        return 0;
     }
 
-    free(A);
+    *G = malloc_matrix(SIMILARITY_BLOCK, engine->X->rows);
+    *workspace = (double*)malloc(gemm_workspace_size() * sizeof(double));
+
+    return *G == NULL || *workspace == NULL ? -1 : 0;
 }
 
 
-double** transpose(double** A, int n, int m) {
-    /* Transpose an n x m matrix */
+static void engine_block(const similarity_engine* engine, matrix* G, double* workspace, int start, int end) {
+    /* Prepare the rows start to end - 1 (at most SIMILARITY_BLOCK of them) in the scratch buffer G. For
+    the Gram method this multiplies them by every point from start on, the pairs under the diagonal of the
+    block are wasted */
 
-    double** B;
-    int i, j;
+    matrix block;
+    matrix points;
+    matrix products;
+    int n;
+
+    if (G == NULL) {
+        return;
+    }
 
-    /* Allocate memory for matrix */
-    B = malloc_matrix(m, n);
+    n = engine->X->rows;
+    block = submatrix(engine->centered, start, 0, end - start, engine->X->cols);
+    points = submatrix(engine->XT, 0, start, engine->X->cols, n - start);
+    products = submatrix(G, 0, 0, end - start, n - start);
+    gemm_workspace(&block, &points, &products, workspace);
+}
 
-    /* Calculate the transpose of the given matrix */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < m; j++) {
-            B[j][i] = A[i][j];
+
+static void similarity_upper_row(const similarity_engine* engine, const matrix* G, int start, int i,
+                                 double* A_row) {
+    /* Calculate row i of the similarity matrix from the main diagonal on, A_row[0] is cell (i, i).
+    engine_block must have prepared G for the block of rows beginning at start that holds i */
+
+    const double* products;
+    double distance;
+    int n, j;
+
+    n = engine->X->rows;
+
+    /* 0 on the main diagonal */
+    A_row[0] = 0;
+
+    /* The matrix is symmetric, so only the pairs with j > i are calculated: first all their distances,
+    then all their similarities */
+    if (G == NULL) {
+        engine->kernels->squared_distances(MATRIX_ROW(engine->X, i), MATRIX_ROW(engine->XT, 0) + i + 1,
+                                           engine->XT->stride, engine->X->cols, n - i - 1, A_row + 1);
+    }
+    else {
+        products = MATRIX_ROW(G, i - start) - start;
+
+        for (j = i + 1; j < n; j++) {
+            /* Round-off can make the distance of very close points slightly negative */
+            distance = engine->norms[i] + engine->norms[j] - 2 * products[j];
+            A_row[j - i] = distance > 0 ? distance : 0;
         }
     }
 
-    return B;
+    engine->kernels->exp_neg_half(A_row + 1, n - i - 1);
 }
 
 
-double** matrix_multiplication(double** A, double** B, int n, int r, int m) {
-    /* Multiply to matrices of size n x r and r x m, respectivley */
-    double** C;
-    int i, j, k;
+static void add_to_degrees(const double* A_row, int i, int n, double* degrees) {
+    /* Add the cells of row i from the main diagonal on to the degrees of both of their points */
 
-    /* Allocate memory for matrix */
-    C = malloc_matrix(n, m);
+    int j;
 
-    /* Calculate matrix multiplication */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < m; j++) {
-            C[i][j] = 0;
+    for (j = i + 1; j < n; j++) {
+        degrees[i] += A_row[j - i];
+        degrees[j] += A_row[j - i];
+    }
+}
+
+
+static void mirror_upper_triangle(matrix* A) {
+    /* Copy the upper triangle of a dense square matrix (of doubles or floats) to its lower triangle */
+
+    int block_i, block_j;
+    int i, j;
+    int end_i, end_j;
+    const int block = 64;
+
+    /* Go over the lower triangle in square blocks so both the reads and the writes stay in cache, every
+    thread writing its own rows */
+    #pragma omp parallel for private(block_j, i, j, end_i, end_j) schedule(dynamic)
+    for (block_i = 0; block_i < A->rows; block_i += block) {
+        end_i = block_i + block < A->rows ? block_i + block : A->rows;
+
+        for (block_j = 0; block_j <= block_i; block_j += block) {
+            end_j = block_j + block < A->cols ? block_j + block : A->cols;
+
+            for (i = block_i; i < end_i; i++) {
+                for (j = block_j; j < end_j && j < i; j++) {
+                    if (A->dtype != MATRIX_FLOAT64) {
+                        matrix_set(A, i, j, matrix_get(A, j, i));
+                    }
+                    else {
+                        MATRIX_AT(A, i, j) = MATRIX_AT(A, j, i);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+static int similarity_pass(const matrix* X, matrix* A, double* degrees) {
+    /* Calculate the upper triangle of the similarity matrix, each pair of points once, over all threads.
+    Rows are stored in A (dense or packed, or dense reduced precision) if it isn't NULL, and their sums added
+    to degrees if it isn't NULL. A row is always calculated in doubles, a reduced precision A gets it rounded.
+    Every thread sums into its own copy of the degrees, so the result only depends on the number of threads.
+    Returns 0, or -1 if there isn't enough memory */
+
+    similarity_engine engine;
+    matrix* G;
+    double* workspace;
+    double* partial;
+    double* A_row;
+    double* row;
+    int n, threads, blocks, failed;
+    int block, start, end;
+    int i, j, t;
+
+    n = X->rows;
+    threads = parallel_threads();
+    blocks = (n + SIMILARITY_BLOCK - 1) / SIMILARITY_BLOCK;
+
+    /* Allocate the degrees of every thread and check for errors */
+    partial = NULL;
+    failed = engine_init(&engine, X) != 0;
+    if (!failed && degrees != NULL) {
+        partial = (double*)calloc((size_t)threads * n, sizeof(double));
+        failed = partial == NULL;
+    }
+    if (failed) {
+        engine_free(&engine);
+        return -1;
+    }
+
+    #pragma omp parallel private(G, workspace, A_row, row, block, start, end, i, j, t) if (blocks > 1)
+    {
+        t = parallel_thread_id();
+
+        /* Without A (or with a reduced precision A) the rows are calculated in a buffer of the thread. The
+        threads agree on a failure to allocate before the loop, a thread can't leave a parallel region on its
+        own */
+        row = NULL;
+        if (engine_scratch(&engine, &G, &workspace) != 0 ||
+            ((A == NULL || A->dtype != MATRIX_FLOAT64) && (row = (double*)malloc(n * sizeof(double))) == NULL)) {
+            #pragma omp atomic
+            failed++;
+        }
+        #pragma omp barrier
+
+        if (failed == 0) {
+            /* Blocks high in the triangle are longer, dealing them out one by one keeps the threads balanced */
+            #pragma omp for schedule(static, 1)
+            for (block = 0; block < blocks; block++) {
+                start = block * SIMILARITY_BLOCK;
+                end = start + SIMILARITY_BLOCK < n ? start + SIMILARITY_BLOCK : n;
+                engine_block(&engine, G, workspace, start, end);
+
+                for (i = start; i < end; i++) {
+                    if (A == NULL || A->dtype != MATRIX_FLOAT64) {
+                        A_row = row;
+                    }
+                    else {
+                        A_row = A->layout == MATRIX_PACKED ? MATRIX_PACKED_ROW(A, i) : MATRIX_ROW(A, i) + i;
+                    }
+                    similarity_upper_row(&engine, G, start, i, A_row);
+                    if (A != NULL && A->dtype != MATRIX_FLOAT64) {
+                        for (j = i; j < n; j++) {
+                            matrix_set(A, i, j, A_row[j - i]);
+                        }
+                    }
+
+                    /* Take the degrees while the row is still in cache */
+                    if (partial != NULL) {
+                        add_to_degrees(A_row, i, n, partial + (size_t)t * n);
+                    }
+                }
+            }
+        }
+
+        free_matrix(G);
+        free(workspace);
+        free(row);
+    }
+
+    /* Add up the degrees of all threads */
+    if (degrees != NULL && failed == 0) {
+        for (i = 0; i < n; i++) {
+            degrees[i] = 0;
 
-            for (k = 0; k < r; k++) {
-                C[i][j] += A[i][k] * B[k][j];
+            for (t = 0; t < threads; t++) {
+                degrees[i] += partial[(size_t)t * n + i];
             }
         }
     }
 
-    return C;
+    free(partial);
+    engine_free(&engine);
+
+    return failed == 0 ? 0 : -1;
 }
 
 
-double euclidean_distance(double* a, double* b, int d) {
-    /* Euclidean distance squared between two points of length d */
+static matrix* similarity_and_degrees(const matrix* X, matrix_layout layout, matrix_dtype dtype, const char* path,
+                                      double* degrees) {
+    /* Calculate the similarity matrix in the given layout (dense or packed) and element type (reduced precision
+    only dense), in memory or if path isn't NULL straight into a matrix file there, and if degrees isn't NULL
+    the sum of every row of it in the same pass. Returns NULL if there isn't enough memory, the file can't be
+    created or a packed reduced precision matrix is asked for */
 
-    double result;
-    int i;
+    matrix* A;
 
-    /* Sum starts at 0 */
-    result = 0;
+    /* Allocate memory (or the file) for matrix */
+    if (dtype != MATRIX_FLOAT64) {
+        A = layout == MATRIX_DENSE && path == NULL ? malloc_matrix_dtype(X->rows, X->rows, dtype) : NULL;
+    }
+    else if (path != NULL) {
+        A = create_matrix_file(path, X->rows, X->rows, layout);
+    }
+    else {
+        A = layout == MATRIX_PACKED ? malloc_packed(X->rows) : malloc_matrix(X->rows, X->rows);
+    }
 
-    /* Calculate distance between two data points */
-    for (i = 0; i < d; i++) {
-        result += pow((a[i] - b[i]), 2);
+    if (A == NULL) {
+        return NULL;
     }
 
-    return result;
+    if (similarity_pass(X, A, degrees) != 0) {
+        free_matrix(A);
+        return NULL;
+    }
+
+    /* A dense matrix also needs its lower triangle */
+    if (layout != MATRIX_PACKED) {
+        mirror_upper_triangle(A);
+    }
+
+    return A;
 }
 
 
-double frobenius_norm(double** A, int n, int m) {
-    /* Frobenius norm squared of a matrix of size n x m */
-    double result;
-    int i, j;
+matrix* sym_c(const matrix* X, matrix_layout layout, matrix_dtype dtype) {
+    /* Calculate the similarity matrix, dense or packed, in double or (dense only) reduced precision */
 
-    /* Sum starts at 0 */
-    result = 0;
+    return similarity_and_degrees(X, layout, dtype, NULL, NULL);
+}
 
-    /* Calculate sum of squares of the cells of the given matrix */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < m; j++) {
-            result += pow(A[i][j], 2);
-        }
+
+matrix* sym_file_c(const matrix* X, const char* path) {
+    /* Calculate the similarity matrix into a packed matrix file, for matrices too large for memory. The
+    result is the file mapped for writing, free_matrix unmaps it */
+
+    return similarity_and_degrees(X, MATRIX_PACKED, MATRIX_FLOAT64, path, NULL);
+}
+
+
+matrix* ddg_c(const matrix* X) {
+    /* Calculate the diagonal degree matrix, only its diagonal is stored */
+
+    matrix* D;
+
+    /* Allocate memory for the diagonal */
+    D = malloc_diagonal(X->rows);
+    if (D == NULL) {
+        return NULL;
     }
 
-    return result;
+    /* Calculate the degrees one similarity row at a time, the full similarity matrix is never stored */
+    if (similarity_pass(X, NULL, (double*)D->data) != 0) {
+        free_matrix(D);
+        return NULL;
+    }
+
+    return D;
 }
 
 
-double** sym_c(double** X, int n, int d) {
-    /* Calculate the similarity matrix */
+static matrix* normalized_similarity(const matrix* X, matrix_layout layout, matrix_dtype dtype, const char* path) {
+    /* Calculate the normalized similarity matrix, dense or packed, in double or single precision, in memory or
+    into a matrix file */
 
-    double** A;
-    int i, j;
+    matrix* W;
+    double* W_row;
+    double* degrees;
+    int n;
+    int i, j, start;
+    double denominator;
+
+    n = X->rows;
 
-    /* Allocate memory for matrix */
-    A = malloc_matrix(n, n);
+    /* Allocate memory for the degrees and check for errors */
+    degrees = (double*)malloc(n * sizeof(double));
+    if (degrees == NULL) {
+        return NULL;
+    }
 
-    /* Calculate the similarity matrix */
+    /* Calculate A and the degrees in a single pass, A is then normalized in place into W */
+    W = similarity_and_degrees(X, layout, dtype, path, degrees);
+    if (W == NULL) {
+        free(degrees);
+        return NULL;
+    }
+
+    /* Keep the square roots of the degrees so they aren't recalculated for every cell */
+    for (i = 0; i < n; i++) {
+        degrees[i] = sqrt(degrees[i]);
+    }
+
+    /* Calculate W, a packed row only holds the cells from the main diagonal on */
+    #pragma omp parallel for private(W_row, start, j, denominator) schedule(dynamic, 64)
     for (i = 0; i < n; i++) {
-        for (j = 0; j < n; j++) {
-            if (i == j) { /* 0 if on the main diagonal */
-                A[i][j] = 0;
+        W_row = NULL;
+        if (dtype == MATRIX_FLOAT64) {
+            W_row = layout == MATRIX_PACKED ? MATRIX_PACKED_ROW(W, i) - i : MATRIX_ROW(W, i);
+        }
+        start = layout == MATRIX_PACKED ? i : 0;
+
+        for (j = start; j < n; j++) {
+            /* Calculate the denominator (D^-1/2 is diagonal so we get that this needs to be divided by to get
+            D ^ -1/2 * A * D ^ -1/2) */
+            denominator = degrees[i] * degrees[j];
+            if (denominator == 0) { /* cant divide by 0, make it a small epsilon */
+                denominator = DENOMINATOR_EPSILON;
+            }
+
+            /* Calculate the value in W, a reduced precision cell is divided in doubles and rounded back */
+            if (W_row == NULL) {
+                matrix_set(W, i, j, matrix_get(W, i, j) / denominator);
             }
-            else { /* Otherwise, calculate similarity */
-                A[i][j] = exp(-(euclidean_distance(X[i], X[j], d))/2);
+            else {
+                W_row[j] /= denominator;
             }
         }
     }
 
-    return A;
+    /* Free memory */
+    free(degrees);
+
+    return W;
 }
 
 
-double** ddg_c(double** X, int n, int d) {
-    /* Calculate the diagonal degree matrix */
+matrix* norm_c(const matrix* X, matrix_layout layout, matrix_dtype dtype) {
+    /* Calculate the normalized similarity matrix, dense or packed, in double or (dense only) reduced precision */
 
-    double** D;
-    double** A;
-    int i, j;
-    double sum;
+    return normalized_similarity(X, layout, dtype, NULL);
+}
 
-    /* Calculate similarity matrix */
-    A = sym_c(X, n, d);
 
-    /* Allocate memory for matrix */
-    D = malloc_matrix(n, n);
+matrix* norm_file_c(const matrix* X, const char* path) {
+    /* Calculate the normalized similarity matrix into a packed matrix file, which symnmf_c can then stream
+    from (see map_matrix_file) */
 
-    /* Initialize matrix */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < n; j++) {
-            D[i][j] = 0;
+    return normalized_similarity(X, MATRIX_PACKED, MATRIX_FLOAT64, path);
+}
+
+
+static void sparse_degrees(const matrix* A, double* degrees) {
+    /* Sum every row of a sparse matrix */
+
+    size_t p;
+    int i;
+
+    #pragma omp parallel for private(p) schedule(static) if ((double)A->offsets[A->rows] > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        degrees[i] = 0;
+
+        for (p = A->offsets[i]; p < A->offsets[i + 1]; p++) {
+            degrees[i] += ((const double*)A->data)[p];
         }
     }
+}
 
-    /* Calculate the D matrix */
-    for (i = 0; i < n; i++) {
-        /* Calculate the sum for each column */
-        sum = 0;
-        for (j = 0; j < n; j++) {
-            sum += A[i][j];
-        }
 
-        /* Set the value on the diagonal to be the sum */
-        D[i][i] = sum;
+static matrix* sparse_ddg(matrix* A) {
+    /* Calculate the diagonal degree matrix of a sparse similarity matrix, which is freed. NULL (for a matrix
+    that couldn't be calculated) gives NULL */
+
+    matrix* D;
+
+    if (A == NULL) {
+        return NULL;
+    }
+
+    D = malloc_diagonal(A->rows);
+    if (D != NULL) {
+        sparse_degrees(A, (double*)D->data);
     }
 
-    /* Free the memory */
-    free_matrix(A, n);
+    free_matrix(A);
 
     return D;
 }
 
 
-double** norm_c(double** X, int n, int d) {
-    /* Calculate the normalized similarity matrix */
+static matrix* sparse_norm(matrix* A) {
+    /* Normalize a sparse similarity matrix in place into W, with the degrees taken on the sparse matrix itself.
+    NULL (for a matrix that couldn't be calculated) gives NULL */
 
-    double** W;
-    double** D;
-    double** A;
-    int i, j;
+    double* values;
+    double* degrees;
     double denominator;
+    size_t p;
+    int i;
 
-    /* Calculate A and D matrices */
-    A = sym_c(X, n, d);
-    D = ddg_c(X, n, d);
+    if (A == NULL) {
+        return NULL;
+    }
 
-    /* Allocate memory for matrix */
-    W = malloc_matrix(n, n);
+    /* Allocate memory for the degrees and check for errors */
+    degrees = (double*)malloc(A->rows * sizeof(double));
+    if (degrees == NULL) {
+        free_matrix(A);
+        return NULL;
+    }
 
-    /* Calculate W */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < n; j++) {
-            /* Calculate the denominator (D^-1/2 is diagonal so we get that this needs to be divided by to get
-            D ^ -1/2 * A * D ^ -1/2) */
-            denominator = sqrt(D[i][i] * D[j][j]);
+    sparse_degrees(A, degrees);
+
+    for (i = 0; i < A->rows; i++) {
+        degrees[i] = sqrt(degrees[i]);
+    }
+
+    values = (double*)A->data;
+
+    #pragma omp parallel for private(p, denominator) schedule(static) \
+        if ((double)A->offsets[A->rows] > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        for (p = A->offsets[i]; p < A->offsets[i + 1]; p++) {
+            denominator = degrees[i] * degrees[A->indices[p]];
             if (denominator == 0) { /* cant divide by 0, make it a small epsilon */
                 denominator = DENOMINATOR_EPSILON;
             }
 
-            /* Calculate the value in W */
-            W[i][j] = A[i][j] / denominator;
+            values[p] /= denominator;
         }
     }
 
     /* Free memory */
-    free_matrix(A, n);
-    free_matrix(D, n);
+    free(degrees);
 
-    return W;
+    return A;
 }
 
 
-void symnmf_c_step(double** H_t, double** H_t1, double** W, int n, int k) {
-    /* Calculate a step in symnmf */
+matrix* sym_knn_c(const matrix* X, int knn) {
+    /* Calculate the sparse similarity matrix of the knn nearest neighbor graph */
 
-    double** WH;
-    double** HT;
-    double** HTH;
-    double** HHTH;
-    int i, j;
+    return knn_similarity(X, knn);
+}
 
-    /* Calculate W * H */
-    WH = matrix_multiplication(W, H_t, n, n, k);
-    /* Calculate H transposed (H^t)*/
-    HT = transpose(H_t, n, k);
-    /* Calculate H^t * H */
-    HTH = matrix_multiplication(HT, H_t, k, n, k);
-    /* Calculate H * H^t * H */
-    HHTH = matrix_multiplication(H_t, HTH, n, k, k);
 
-    /* Calculate one step of symNMF */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < k; j++) {
-            if (HHTH[i][j] == 0) { /* cant divide by 0, make it epsilon */
-                HHTH[i][j] += DENOMINATOR_EPSILON;
-            }
+matrix* ddg_knn_c(const matrix* X, int knn) {
+    /* Calculate the diagonal degree matrix of the knn nearest neighbor graph */
+
+    return sparse_ddg(knn_similarity(X, knn));
+}
+
+
+matrix* norm_knn_c(const matrix* X, int knn) {
+    /* Calculate the sparse normalized similarity matrix of the knn nearest neighbor graph */
+
+    return sparse_norm(knn_similarity(X, knn));
+}
+
+
+matrix* sym_cutoff_c(const matrix* X, double cutoff, truncation_report* report) {
+    /* Calculate the sparse similarity matrix without the cells under cutoff, report (if not NULL) tells how
+    much was left out */
+
+    return cutoff_similarity(X, cutoff, report);
+}
+
+
+matrix* ddg_cutoff_c(const matrix* X, double cutoff, truncation_report* report) {
+    /* Calculate the diagonal degree matrix of the similarity matrix without the cells under cutoff */
+
+    return sparse_ddg(cutoff_similarity(X, cutoff, report));
+}
+
+
+matrix* norm_cutoff_c(const matrix* X, double cutoff, truncation_report* report) {
+    /* Calculate the sparse normalized similarity matrix without the cells under cutoff */
+
+    return sparse_norm(cutoff_similarity(X, cutoff, report));
+}
+
+
+static int low_rank_degrees(const matrix* A, double* degrees) {
+    /* Sum every row of a low rank matrix A = G * G^t - diag(c): G times the sums of the columns of G, minus c.
+    Returns 0, or -1 if there isn't enough memory */
+
+    double* sums;
+    int i, p;
+
+    /* Allocate memory for the sums of the columns of G and check for errors */
+    sums = (double*)calloc((size_t)A->rank + 1, sizeof(double));
+    if (sums == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < A->rows; i++) {
+        for (p = 0; p < A->rank; p++) {
+            sums[p] += MATRIX_AT(A, i, p);
+        }
+    }
+
+    #pragma omp parallel for private(p) schedule(static) if ((double)A->rows * A->rank > PARALLEL_MIN_WORK)
+    for (i = 0; i < A->rows; i++) {
+        degrees[i] = -MATRIX_LOW_RANK_DIAGONAL(A)[i];
+
+        for (p = 0; p < A->rank; p++) {
+            degrees[i] += MATRIX_AT(A, i, p) * sums[p];
+        }
+    }
+
+    free(sums);
+
+    return 0;
+}
+
+
+matrix* sym_nystrom_c(const matrix* X, int landmarks) {
+    /* Approximate the similarity matrix from landmarks sampled points, as a low rank matrix */
+
+    return nystrom_similarity(X, landmarks);
+}
+
 
-            /* Calculate the cell in new H */
-            H_t1[i][j] = H_t[i][j] * (1 - BETA + (BETA * (WH[i][j] / HHTH[i][j])));
+matrix* ddg_nystrom_c(const matrix* X, int landmarks) {
+    /* Approximate the diagonal degree matrix from landmarks sampled points */
+
+    matrix* A;
+    matrix* D;
+
+    A = nystrom_similarity(X, landmarks);
+    D = A != NULL ? malloc_diagonal(X->rows) : NULL;
+    if (D != NULL && low_rank_degrees(A, (double*)D->data) != 0) {
+        free_matrix(D);
+        D = NULL;
+    }
+
+    free_matrix(A);
+
+    return D;
+}
+
+
+matrix* norm_nystrom_c(const matrix* X, int landmarks) {
+    /* Approximate the normalized similarity matrix from landmarks sampled points, as a low rank matrix.
+    D^-1/2 * (F * F^t - diag(c)) * D^-1/2 is G * G^t - diag(c) * D^-1 for G = D^-1/2 * F, with the degrees of
+    the approximation. A point far from every landmark can get a degree of about 0 or under it; scaling its
+    row by DENOMINATOR_EPSILON would blow up the approximation error into huge (also negative) cells, so such a
+    point is left without neighbors, a row and column of 0s */
+
+    matrix* W;
+    double* degrees;
+    double scale;
+    int i, p;
+
+    /* Allocate memory for the degrees and check for errors */
+    degrees = (double*)malloc(X->rows * sizeof(double));
+    if (degrees == NULL) {
+        return NULL;
+    }
+
+    /* A is normalized in place into W */
+    W = nystrom_similarity(X, landmarks);
+    if (W == NULL || low_rank_degrees(W, degrees) != 0) {
+        free_matrix(W);
+        free(degrees);
+        return NULL;
+    }
+
+    #pragma omp parallel for private(scale, p) schedule(static) if ((double)W->rows * W->rank > PARALLEL_MIN_WORK)
+    for (i = 0; i < W->rows; i++) {
+        scale = degrees[i] > DENOMINATOR_EPSILON ? 1 / sqrt(degrees[i]) : 0;
+        for (p = 0; p < W->rank; p++) {
+            MATRIX_AT(W, i, p) *= scale;
         }
+        MATRIX_LOW_RANK_DIAGONAL(W)[i] *= scale * scale;
     }
 
     /* Free memory */
-    free_matrix(WH, n);
-    free_matrix(HT, k);
-    free_matrix(HTH, k);
-    free_matrix(HHTH, n);
+    free(degrees);
+
+    return W;
 }
 
 
-double** symnmf_c(double** H_0, double** W, int n, int k) {
-    /* Find an optimized H */
-    double** H_t;
-    double** H_t1;
-    double** delta;
-    int i, j;
-    int iter;
-    H_t = malloc_matrix(n, k);
-    H_t1 = malloc_matrix(n, k);
-    delta = malloc_matrix(n, k);
-    /* Initialize H_t to be H_0 */
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < k; j++) {
-            H_t[i][j] = H_0[i][j];
+/* Memory symnmf_c reuses through all its iterations, so no step allocates anything. H may hold several runs
+side by side (restarts of width columns each), they share every product with W but are otherwise independent.
+The runs still going are kept in the first columns, so the steps only multiply W by those */
+typedef struct {
+    matrix* H[2]; /* the current H and the next one, swapped after every step */
+    matrix* HTH; /* H_s^t * H_s (width x width) of every run s still going, stacked */
+    matrix* WH; /* W * H, only for packed W which can't be multiplied a block of rows at a time */
+    double* packed; /* H packed for the blocked kernel, dense W only (as floats for reduced precision W) */
+    double* tiles; /* a SYMNMF_BLOCK x k block of W * H for every thread, dense, sparse and low rank W */
+    matrix* GtH; /* G^t * H for low rank W = G * G^t - diag(c) */
+    double* scratch; /* copies of H^t * H of the threads, and the scratch memory of W * H for packed W and of
+                      G^t * H for low rank W */
+    double* moved; /* how far every run moved in the last step (squared), per thread and then summed up */
+    int* order; /* the run in every group of width columns of H */
+    int restarts;
+    int running; /* runs that didn't converge yet, in the first running groups */
+    int width;
+    int threads;
+} symnmf_workspace;
+
+
+static int workspace_init(symnmf_workspace* ws, const matrix* H_0, const matrix* W, int restarts) {
+    /* Allocate the buffers of the iterations for H_0 of size n x k (restarts runs of k / restarts columns each)
+    and W of size n x n. Returns 0, or -1 if there isn't enough memory, workspace_free then frees what was
+    allocated */
+
+    matrix G;
+    size_t size, packed;
+    int n, k;
+    int s;
+
+    n = H_0->rows;
+    k = H_0->cols;
+
+    ws->threads = parallel_threads();
+    ws->restarts = restarts;
+    ws->width = k / restarts;
+    ws->H[0] = malloc_matrix(n, k);
+    ws->H[1] = malloc_matrix(n, k);
+    ws->HTH = malloc_matrix(k, ws->width);
+    ws->WH = NULL;
+    ws->packed = NULL;
+    ws->tiles = NULL;
+    ws->GtH = NULL;
+    ws->moved = (double*)malloc((size_t)(ws->threads + 1) * restarts * sizeof(double));
+    ws->order = (int*)malloc((size_t)restarts * sizeof(int));
+    ws->running = restarts;
+
+    for (s = 0; s < restarts && ws->order != NULL; s++) {
+        ws->order[s] = s;
+    }
+
+    size = (size_t)ws->threads * k * ws->width;
+    if (W->layout == MATRIX_LOW_RANK) {
+        G = low_rank_factor(W);
+        ws->GtH = malloc_matrix(W->rank, k);
+        size = transposed_workspace_size(&G, H_0) > size ? transposed_workspace_size(&G, H_0) : size;
+    }
+    if (W->layout == MATRIX_PACKED) {
+        ws->WH = malloc_matrix(n, k);
+        size = multiplication_workspace_size(W, H_0) > size ? multiplication_workspace_size(W, H_0) : size;
+    }
+    else {
+        /* Reduced precision W multiplies H packed as floats, in half the room */
+        packed = W->dtype != MATRIX_FLOAT64 ? (gemm_packed_size_float32(H_0) + 1) / 2 : gemm_packed_size(H_0);
+        ws->packed = W->layout == MATRIX_DENSE ? (double*)malloc(packed * sizeof(double)) : NULL;
+        ws->tiles = (double*)malloc((size_t)ws->threads * SYMNMF_BLOCK * k * sizeof(double));
+        if ((W->layout == MATRIX_DENSE && ws->packed == NULL) || ws->tiles == NULL) {
+            ws->scratch = NULL;
+            return -1;
         }
     }
-    /* Do symnmf step until convergence or max_iter reached */
-    for (iter = 0; iter < MAX_ITER; iter++) {
-        symnmf_c_step(H_t, H_t1, W, n, k);
-        /* Calculate difference between H_t1 and H_t for frobenius norm */
-        for (i = 0; i < n; i++) {
-            for (j = 0; j < k; j++) {
-                delta[i][j] = H_t1[i][j] - H_t[i][j];
+
+    ws->scratch = (double*)malloc(size * sizeof(double));
+
+    if (ws->H[0] == NULL || ws->H[1] == NULL || ws->HTH == NULL || ws->scratch == NULL || ws->moved == NULL ||
+        ws->order == NULL || (W->layout == MATRIX_LOW_RANK && ws->GtH == NULL) ||
+        (W->layout == MATRIX_PACKED && ws->WH == NULL)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void workspace_free(symnmf_workspace* ws) {
+    /* Free the buffers of the iterations, except the ones already set to NULL */
+
+    if (ws->H[0] != NULL) {
+        free_matrix(ws->H[0]);
+    }
+    if (ws->H[1] != NULL) {
+        free_matrix(ws->H[1]);
+    }
+    if (ws->WH != NULL) {
+        free_matrix(ws->WH);
+    }
+    if (ws->GtH != NULL) {
+        free_matrix(ws->GtH);
+    }
+    free_matrix(ws->HTH);
+    free(ws->packed);
+    free(ws->tiles);
+    free(ws->scratch);
+    free(ws->moved);
+    free(ws->order);
+}
+
+
+static void gram_matrix(symnmf_workspace* ws, const matrix* H) {
+    /* Calculate H_s^t * H_s (width x width) of every run s in H straight from its rows. Every thread sums
+    its rows into its own copy, the copies are added up in thread order so the result only depends on the number
+    of threads */
+
+    const double* row;
+    double* partial;
+    double* sums;
+    int threads;
+    int k, w;
+    int i, a, b, s, t;
+
+    k = H->cols;
+    w = ws->width;
+    threads = (double)H->rows * k * w > PARALLEL_MIN_WORK ? ws->threads : 1;
+
+    /* The copies start from 0, also the ones of threads OpenMP might not start */
+    memset(ws->scratch, 0, (size_t)threads * k * w * sizeof(double));
+
+    #pragma omp parallel private(partial, sums, row, i, a, b, s) num_threads(threads)
+    {
+        partial = ws->scratch + (size_t)parallel_thread_id() * k * w;
+
+        #pragma omp for schedule(static)
+        for (i = 0; i < H->rows; i++) {
+            for (s = 0; s < k / w; s++) {
+                row = MATRIX_ROW(H, i) + (size_t)s * w;
+                sums = partial + (size_t)s * w * w;
+
+                /* Only the upper triangle, H_s^t * H_s is symmetric */
+                for (a = 0; a < w; a++) {
+                    for (b = a; b < w; b++) {
+                        sums[a * w + b] += row[a] * row[b];
+                    }
+                }
             }
         }
-        /* Move H_t1 to H_t before convergence check */
-        for (i = 0; i < n; i++) {
-            for (j = 0; j < k; j++) {
-                H_t[i][j] = H_t1[i][j];
+    }
+
+    for (s = 0; s < k / w; s++) {
+        for (a = s * w; a < (s + 1) * w; a++) {
+            for (b = a - s * w; b < w; b++) {
+                MATRIX_AT(ws->HTH, a, b) = 0;
+                for (t = 0; t < threads; t++) {
+                    MATRIX_AT(ws->HTH, a, b) += ws->scratch[(size_t)t * k * w + (size_t)a * w + b];
+                }
+                MATRIX_AT(ws->HTH, s * w + b, a - s * w) = MATRIX_AT(ws->HTH, a, b);
             }
         }
-        /* Check convergence */
-        if (frobenius_norm(delta, n, k) < EPSILON) {
-            break;
+    }
+}
+
+
+static void update_rows(const symnmf_workspace* ws, const matrix* H_t, matrix* H_t1, int start, int end,
+                        const double* WH, size_t ldwh, double* moved) {
+    /* Calculate rows start to end - 1 of the next H given the same rows of W * H, adding how far every run moved
+    (squared) to moved. The rows of H_s * H_s^t * H_s are calculated on the spot, a row at a time */
+
+    const double* HTH;
+    const double* H_row;
+    double* H1_row;
+    double numerator;
+    double denominator;
+    double delta;
+    size_t ldhth;
+    int w;
+    int i, j, a, s;
+
+    w = ws->width;
+    ldhth = ws->HTH->stride;
+
+    for (i = start; i < end; i++) {
+        for (s = 0; s < H_t->cols / w; s++) {
+            H_row = MATRIX_ROW(H_t, i) + (size_t)s * w;
+            H1_row = MATRIX_ROW(H_t1, i) + (size_t)s * w;
+
+            HTH = MATRIX_ROW(ws->HTH, s * w);
+            for (j = 0; j < w; j++) {
+                /* Cell (i, j) of H_s * H_s^t * H_s */
+                denominator = 0;
+                for (a = 0; a < w; a++) {
+                    denominator += H_row[a] * HTH[a * ldhth + j];
+                }
+                if (denominator == 0) { /* cant divide by 0, make it epsilon */
+                    denominator = DENOMINATOR_EPSILON;
+                }
+
+                /* Calculate the cell in new H */
+                numerator = WH[(size_t)(i - start) * ldwh + (size_t)s * w + j];
+                H1_row[j] = H_row[j] * (1 - BETA + (BETA * (numerator / denominator)));
+
+                delta = H1_row[j] - H_row[j];
+                moved[s] += delta * delta;
+            }
         }
     }
-    free_matrix(H_t1, n);
-    free_matrix(delta, n);
-    return H_t;
 }
 
-void calculate_dimensions(FILE* file, int* n, int* d) {
-    /* Calculate the dimensions of a matrix from file */
 
-    char c;
+static void symnmf_c_step(symnmf_workspace* ws, const matrix* H_t, matrix* H_t1, const matrix* W) {
+    /* Calculate a step in symnmf from H_t into H_t1 for every run in them, the squared frobenius norm of how far
+    each of them moved ends up in the last restarts cells of ws->moved.
+    With dense, sparse or low rank W every thread multiplies a block of rows of W by H into a tile that stays in
+    L1/L2 and updates the block right away, so neither W * H nor H * H^t * H is ever written to memory. All the
+    runs come out of the same pass over W */
+
+    matrix G;
+    matrix GtH;
+    matrix WH;
+    double* tile;
+    double* moved;
+    double* norms;
+    int start, end;
+    int n, k;
+    int threads;
+    int runs;
+    int s, t;
+
+    n = H_t->rows;
+    k = H_t->cols;
+    runs = k / ws->width;
+    if (W->layout == MATRIX_CSR) {
+        threads = (double)W->offsets[n] * k > PARALLEL_MIN_WORK ? ws->threads : 1;
+    }
+    else if (W->layout == MATRIX_LOW_RANK) {
+        threads = (double)n * W->rank * k > PARALLEL_MIN_WORK ? ws->threads : 1;
+    }
+    else {
+        threads = (double)n * n * k > PARALLEL_MIN_WORK ? ws->threads : 1;
+    }
 
-    /* Check if file was opened correctly */
-    if (file == NULL) {
-        printf("An Error Has Occurred\n");
-        exit(1);
+    /* Calculate H^t * H, needed by every block */
+    gram_matrix(ws, H_t);
+
+    /* Calculate W * H whole for packed W, a row of it adds to many rows of the product. Otherwise pack H once,
+    every block of dense W is multiplied by it. Low rank W needs G^t * H (rank x k) instead, then a block of
+    W * H is a block of G times it */
+    if (W->layout == MATRIX_PACKED) {
+        WH = *ws->WH;
+        WH.cols = k;
+        multiply_into(W, H_t, &WH, ws->scratch);
+    }
+    else if (W->layout == MATRIX_DENSE && W->dtype != MATRIX_FLOAT64) {
+        gemm_pack_float32(H_t, (float*)ws->packed);
+    }
+    else if (W->layout == MATRIX_DENSE) {
+        gemm_pack(H_t, ws->packed);
+    }
+    else if (W->layout == MATRIX_LOW_RANK) {
+        G = low_rank_factor(W);
+        GtH = *ws->GtH;
+        GtH.cols = k;
+        transposed_multiply_into(&G, H_t, &GtH, ws->scratch);
     }
 
-    /* Initialize dimensions */
-    *n = 0;
-    *d = 0;
+    /* The sums of the threads start from 0, also the ones of threads OpenMP might not start */
+    memset(ws->moved, 0, (size_t)threads * runs * sizeof(double));
 
-    /* Count the number of ',' and '\n' to calculate the dimensions from */
-    while ((c = fgetc(file)) != EOF) {
-        if (c == ',') {
-            (*d)++;
-        }
-        else if (c == '\n') {
-            (*n)++;
+    #pragma omp parallel private(tile, moved, start, end) num_threads(threads)
+    {
+        moved = ws->moved + (size_t)parallel_thread_id() * runs;
+
+        #pragma omp for schedule(static)
+        for (start = 0; start < n; start += SYMNMF_BLOCK) {
+            end = start + SYMNMF_BLOCK < n ? start + SYMNMF_BLOCK : n;
+            if (W->layout == MATRIX_PACKED) {
+                update_rows(ws, H_t, H_t1, start, end, MATRIX_ROW(ws->WH, start), ws->WH->stride, moved);
+                continue;
+            }
+
+            tile = ws->tiles + (size_t)parallel_thread_id() * SYMNMF_BLOCK * k;
+            if (W->layout == MATRIX_CSR) {
+                csr_rows(W, H_t, start, end - start, tile, (size_t)k);
+            }
+            else if (W->layout == MATRIX_LOW_RANK) {
+                low_rank_rows(W, H_t, &GtH, start, end - start, tile, (size_t)k);
+            }
+            else if (W->dtype != MATRIX_FLOAT64) {
+                gemm_rows_float32(W, H_t, (const float*)ws->packed, start, end - start, tile, (size_t)k);
+            }
+            else {
+                gemm_rows(W, H_t, ws->packed, start, end - start, tile, (size_t)k);
+            }
+            update_rows(ws, H_t, H_t1, start, end, tile, (size_t)k, moved);
         }
     }
 
-    /* Calculate the number of elements in a line, the amount of ',' divided by the number of lines + 1*/
-    *d /= *n;
-    (*d)++;
+    /* Add up the sums of the threads in thread order */
+    norms = ws->moved + (size_t)ws->threads * ws->restarts;
+    for (s = 0; s < runs; s++) {
+        norms[s] = 0;
+        for (t = 0; t < threads; t++) {
+            norms[s] += ws->moved[(size_t)t * runs + s];
+        }
+    }
 }
 
 
-double** proccess_input_file(char* file_name, int* n, int* d) {
-    /* Proccess an input file */
-    FILE* file;
-    double** A;
-    double value;
+static void swap_runs(const symnmf_workspace* ws, matrix* H, int first, int second) {
+    /* Swap the groups of width columns of H that hold two runs */
+
+    double cell;
+    int w;
     int i, j;
-    
-    /* Open the wanted file */
-    file = fopen(file_name, "r");
-
-    /* Calculate the dimensions of the matrix in the file */
-    calculate_dimensions(file, n, d);
-
-    /* Start reading from the beginning of the file after calculating the dimensions */
-    fseek(file, 0, SEEK_SET);
-
-    /* Allocate space to save the matrix from the file to */
-    A = malloc_matrix(*n, *d);
-    
-    /* Load values into A */
-    for (i = 0; i < *n; i++) {
-        for (j = 0; j < *d; j++) {
-            if (fscanf(file, "%lf", &value) != 1) {
-                printf("An Error Has Occurred\n");
-                fclose(file);
-                exit(1);
-            }
 
-            A[i][j] = value;
-            
-            /* skip commas and newlines */
-            fgetc(file);
+    w = ws->width;
+    for (i = 0; i < H->rows; i++) {
+        for (j = 0; j < w; j++) {
+            cell = MATRIX_AT(H, i, first * w + j);
+            MATRIX_AT(H, i, first * w + j) = MATRIX_AT(H, i, second * w + j);
+            MATRIX_AT(H, i, second * w + j) = cell;
         }
     }
+}
 
-    /* Close the file */
-    fclose(file);
 
-    return A;
+static int symnmf_iterate(symnmf_workspace* ws, const matrix* H_0, const matrix* W, double tol, int max_iter) {
+    /* Run the steps from H_0 until every run converged (a step moved it by less than tol) or max_iter steps were
+    made, and return which of ws->H holds the result. ws->order tells where every run ended up */
+
+    matrix H_t, H_t1;
+    const double* norms;
+    int current;
+    int last;
+    int i, j, s;
+    int iter;
+
+    /* Initialize H_t to be H_0 */
+    current = 0;
+    for (i = 0; i < H_0->rows; i++) {
+        for (j = 0; j < H_0->cols; j++) {
+            MATRIX_AT(ws->H[current], i, j) = MATRIX_AT(H_0, i, j);
+        }
+    }
+
+    /* Do symnmf step until convergence or max_iter reached, the new H becomes the current one by swapping
+    the buffers. Only the first columns, of the runs still going, take part in a step */
+    norms = ws->moved + (size_t)ws->threads * ws->restarts;
+    for (iter = 0; iter < max_iter && ws->running > 0; iter++) {
+        current = 1 - current;
+        H_t = *ws->H[1 - current];
+        H_t1 = *ws->H[current];
+        H_t.cols = ws->running * ws->width;
+        H_t1.cols = H_t.cols;
+        symnmf_c_step(ws, &H_t, &H_t1, W);
+
+        /* A run that converged moves behind the ones still going, into both buffers since neither is written
+        there anymore. Going from the last one keeps the norms of the runs yet to be checked in place */
+        for (s = ws->running - 1; s >= 0; s--) {
+            if (norms[s] < tol) {
+                last = ws->running - 1;
+                if (s != last) {
+                    swap_runs(ws, ws->H[current], s, last);
+                    j = ws->order[s];
+                    ws->order[s] = ws->order[last];
+                    ws->order[last] = j;
+                }
+                for (i = 0; i < H_0->rows; i++) {
+                    memcpy(MATRIX_ROW(ws->H[1 - current], i) + (size_t)last * ws->width,
+                           MATRIX_ROW(ws->H[current], i) + (size_t)last * ws->width, ws->width * sizeof(double));
+                }
+                ws->running--;
+            }
+        }
+    }
+
+    return current;
 }
 
 
-void print_matrix(double** A, int n, int m) {
-    /* Print an n x m matrix */
+matrix* init_H_c(const matrix* W, int k, unsigned long seed) {
+    /* A random initial H of size n x k for W of size n x n, like init_H of symnmf.py: cells uniform in
+    [0, 2 * sqrt(m / k)] for m the average cell of W. They come from the linear congruential generator the
+    Nystrom landmarks use, started from seed, so they differ from what numpy draws. NULL if there isn't enough
+    memory */
+
+    matrix* H;
+    unsigned long state;
+    double bound;
     int i, j;
 
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < m; j++) {
-            printf("%.4f", A[i][j]);
+    H = malloc_matrix(W->rows, k);
+    if (H == NULL) {
+        return NULL;
+    }
+
+    bound = W->rows > 0 ? 2 * sqrt(matrix_sum(W) / ((double)W->rows * W->rows) / k) : 0;
+
+    state = seed & 0x7fffffffUL;
+    for (i = 0; i < H->rows; i++) {
+        for (j = 0; j < k; j++) {
+            state = (state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+            MATRIX_AT(H, i, j) = bound * ((double)state / 2147483648.0);
+        }
+    }
+
+    return H;
+}
+
+
+matrix* symnmf_c(const matrix* H_0, const matrix* W) {
+    /* Find an optimized H with the default convergence threshold and number of iterations */
+
+    return symnmf_fit_c(H_0, W, EPSILON, MAX_ITER);
+}
+
+
+matrix* symnmf_fit_c(const matrix* H_0, const matrix* W, double tol, int max_iter) {
+    /* Find an optimized H, stopping once a step changes it by less than tol (squared frobenius norm) or after
+    max_iter steps. NULL if there isn't enough memory */
+    symnmf_workspace ws;
+    matrix* H_t;
+    int current;
+
+    if (workspace_init(&ws, H_0, W, 1) != 0) {
+        workspace_free(&ws);
+        return NULL;
+    }
+
+    current = symnmf_iterate(&ws, H_0, W, tol, max_iter);
+
+    /* The latest H is handed to the caller, everything else is freed */
+    H_t = ws.H[current];
+    ws.H[current] = NULL;
+    workspace_free(&ws);
+
+    return H_t;
+}
+
+
+matrix* symnmf_restarts_c(const matrix* H_0, const matrix* W, int restarts, double tol, int max_iter,
+                          double* objectives, int* best) {
+    /* Run symnmf from restarts initial H at once: H_0 is n x (restarts * k), run s starts from columns s * k to
+    (s + 1) * k - 1. Every pass over W serves all the runs and each of them stops on its own like symnmf_fit_c
+    does. Returns the H (n x k) with the lowest ||W - H * H^t||^2, which of the runs it came from goes into
+    best and the objective of every run into objectives (either may be NULL). NULL if there isn't enough
+    memory */
+    symnmf_workspace ws;
+    matrix* H_t;
+    matrix* WH;
+    matrix* result;
+    double* scores;
+    double W_norm;
+    double trace, gram;
+    int current;
+    int w;
+    int i, j, s;
+    int chosen, slot;
+
+    if (restarts < 1 || H_0->cols % restarts != 0) {
+        return NULL;
+    }
+    if (workspace_init(&ws, H_0, W, restarts) != 0) {
+        workspace_free(&ws);
+        return NULL;
+    }
+
+    current = symnmf_iterate(&ws, H_0, W, tol, max_iter);
+    H_t = ws.H[current];
+    w = ws.width;
+
+    /* ||W - H_s * H_s^t||^2 = ||W||^2 - 2 * tr(H_s^t * W * H_s) + ||H_s^t * H_s||^2, one more pass over W
+    gives W * H for all the runs */
+    WH = matrix_multiplication(W, H_t);
+    scores = ws.moved; /* the step sums aren't needed anymore */
+    if (WH == NULL) {
+        workspace_free(&ws);
+        return NULL;
+    }
+    gram_matrix(&ws, H_t);
+    W_norm = frobenius_norm(W);
+
+    for (s = 0; s < restarts; s++) {
+        trace = 0;
+        for (i = 0; i < H_t->rows; i++) {
+            for (j = s * w; j < (s + 1) * w; j++) {
+                trace += MATRIX_AT(H_t, i, j) * MATRIX_AT(WH, i, j);
+            }
+        }
+        gram = 0;
+        for (i = s * w; i < (s + 1) * w; i++) {
+            for (j = 0; j < w; j++) {
+                gram += MATRIX_AT(ws.HTH, i, j) * MATRIX_AT(ws.HTH, i, j);
+            }
+        }
+        scores[ws.order[s]] = W_norm - 2 * trace + gram;
+    }
+    chosen = 0;
+    for (s = 1; s < restarts; s++) {
+        if (scores[s] < scores[chosen]) {
+            chosen = s;
+        }
+    }
+    free_matrix(WH);
 
-            if (j < m - 1) {
-                printf(",");
+    /* Copy the best run out of the block */
+    slot = 0;
+    while (ws.order[slot] != chosen) {
+        slot++;
+    }
+    result = malloc_matrix(H_t->rows, w);
+    if (result != NULL) {
+        for (i = 0; i < H_t->rows; i++) {
+            for (j = 0; j < w; j++) {
+                MATRIX_AT(result, i, j) = MATRIX_AT(H_t, i, slot * w + j);
             }
         }
+        for (s = 0; s < restarts && objectives != NULL; s++) {
+            objectives[s] = scores[s];
+        }
+        if (best != NULL) {
+            *best = chosen;
+        }
+    }
+
+    workspace_free(&ws);
+
+    return result;
+}
+
+matrix* proccess_input_file(char* file_name) {
+    /* Proccess an input file ("-" for stdin), a dense matrix file is mapped as it is and anything else parsed
+    as CSV. Returns NULL for a packed matrix file, its rows can't be read as points */
 
-        printf("\n");
+    matrix* X;
+
+    if (strcmp(file_name, "-") != 0 && is_matrix_file(file_name)) {
+        X = map_matrix_file(file_name);
+        if (X != NULL && X->layout != MATRIX_DENSE) {
+            free_matrix(X);
+            X = NULL;
+        }
+        return X;
+    }
+
+    return read_csv(file_name);
+}
+
+
+void print_matrix(const matrix* A) {
+    /* Print an n x m matrix of any layout, formatted over all threads and written past stdio */
+
+    fflush(stdout);
+    if (write_matrix(A, STDOUT_FILENO) != 0) {
+        printf("An Error Has Occurred\n");
+        exit(1);
     }
 }
 
@@ -409,40 +1290,180 @@ void print_matrix(double** A, int n, int m) {
 int main(int argc, char* argv[]) {
     char* goal;
     char* file_name;
-    double** X;
-    double** result;
-    int n, d;
-    
+    char* output_file;
+    matrix* X;
+    matrix* result;
+    matrix* exact;
+    matrix_layout layout;
+    matrix_dtype dtype;
+    int threads;
+    int knn;
+    int landmarks;
+    double cutoff;
+    double max_error, relative_error;
+    truncation_report report;
+    int arg;
+
+    /* Proccess optional flags, they come before the goal */
+    layout = MATRIX_DENSE;
+    dtype = MATRIX_FLOAT64;
+    threads = 0;
+    knn = 0;
+    landmarks = 0;
+    cutoff = 0;
+    output_file = NULL;
+    for (arg = 1; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--packed") == 0) { /* store sym and norm results as a packed triangle */
+            layout = MATRIX_PACKED;
+        }
+        else if (strcmp(argv[arg], "--precision") == 0 && arg + 1 < argc) { /* of sym and norm results */
+            if (matrix_dtype_from_name(argv[++arg], &dtype) != 0) {
+                printf("An Error Has Occurred\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) { /* number of threads to use */
+            threads = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--knn") == 0 && arg + 1 < argc) { /* sparse graph of the knn nearest */
+            knn = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--cutoff") == 0 && arg + 1 < argc) { /* sparse, without cells under it */
+            cutoff = atof(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--landmarks") == 0 && arg + 1 < argc) { /* Nystrom, from this many points */
+            landmarks = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--file") == 0 && arg + 1 < argc) { /* sym, norm and convert write a matrix file */
+            output_file = argv[++arg];
+        }
+        else {
+            break;
+        }
+    }
+
     /* Check correct number of args */
-    if (argc != 3) {
-        printf("Usage: ./symnmf <goal> <file_name>\n");
+    if (argc - arg != 2) {
+        printf("Usage: ./symnmf [--packed | --precision <double|single|half|bfloat16>] [--threads <n>] [--knn <k> | "
+               "--cutoff <c> | --landmarks <m> | --file <matrix_file>] <goal> <file_name>\n"
+               "       ./symnmf --file <matrix_file> convert <file_name>\n");
         return 1;
     }
 
+    /* 0 threads means SYMNMF_NUM_THREADS or every core */
+    parallel_set_threads(threads);
+
     /* Proccess args*/
-    goal = argv[1];
-    file_name = argv[2];
+    goal = argv[arg];
+    file_name = argv[arg + 1];
     /* Get matrix from input file */
-    X = proccess_input_file(file_name, &n, &d);
+    X = proccess_input_file(file_name);
+    if (X == NULL) {
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+
+    /* A cutoff has to be a similarity, between 0 and 1 */
+    if (cutoff < 0 || cutoff >= 1) {
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+
+    /* Only X and the dense similarity matrices are written to a matrix file */
+    if (output_file != NULL && (knn > 0 || cutoff > 0 || landmarks > 0 || strcmp(goal, "ddg") == 0)) {
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+
+    /* Converting only writes X to the matrix file, later runs map it instead of parsing the CSV again */
+    if (strcmp(goal, "convert") == 0 && output_file != NULL) {
+        if (write_matrix_file(X, output_file) != 0) {
+            printf("An Error Has Occurred\n");
+            exit(1);
+        }
+        free_matrix(X);
+        return 0;
+    }
 
-    if (strcmp(goal, "sym") == 0) {
-        result = sym_c(X, n, d);
+    if (strcmp(goal, "sym") == 0 && knn > 0) {
+        result = sym_knn_c(X, knn);
+    }
+    else if (strcmp(goal, "sym") == 0 && cutoff > 0) {
+        result = sym_cutoff_c(X, cutoff, &report);
+    }
+    else if (strcmp(goal, "sym") == 0 && landmarks > 0) {
+        result = sym_nystrom_c(X, landmarks);
+    }
+    else if (strcmp(goal, "sym") == 0 && output_file != NULL) {
+        result = sym_file_c(X, output_file);
+    }
+    else if (strcmp(goal, "sym") == 0) {
+        result = sym_c(X, layout, dtype);
+    }
+    else if (strcmp(goal, "ddg") == 0 && knn > 0) {
+        result = ddg_knn_c(X, knn);
+    }
+    else if (strcmp(goal, "ddg") == 0 && cutoff > 0) {
+        result = ddg_cutoff_c(X, cutoff, &report);
+    }
+    else if (strcmp(goal, "ddg") == 0 && landmarks > 0) {
+        result = ddg_nystrom_c(X, landmarks);
     }
     else if (strcmp(goal, "ddg") == 0) {
-        result = ddg_c(X, n, d);
+        result = ddg_c(X);
+    }
+    else if (strcmp(goal, "norm") == 0 && knn > 0) {
+        result = norm_knn_c(X, knn);
+    }
+    else if (strcmp(goal, "norm") == 0 && cutoff > 0) {
+        result = norm_cutoff_c(X, cutoff, &report);
+    }
+    else if (strcmp(goal, "norm") == 0 && landmarks > 0) {
+        result = norm_nystrom_c(X, landmarks);
+    }
+    else if (strcmp(goal, "norm") == 0 && output_file != NULL) {
+        result = norm_file_c(X, output_file);
     }
     else if (strcmp(goal, "norm") == 0) {
-        result = norm_c(X, n, d);
+        result = norm_c(X, layout, dtype);
     }
     else {
+        result = NULL;
+    }
+
+    /* An unknown goal, or not enough memory (or room for the matrix file) for the result */
+    if (result == NULL) {
         printf("An Error Has Occurred\n");
         exit(1);
     }
 
-    /* Print the result matrix */
-    print_matrix(result, n, n);
+    /* How far the Nystrom approximation is from the exact matrix goes to stderr, stdout only holds the matrix */
+    if (knn <= 0 && cutoff <= 0 && landmarks > 0 && X->rows <= NYSTROM_REPORT_MAX_POINTS) {
+        exact = strcmp(goal, "sym") == 0 ? sym_c(X, MATRIX_DENSE, MATRIX_FLOAT64) :
+            (strcmp(goal, "ddg") == 0 ? ddg_c(X) : norm_c(X, MATRIX_DENSE, MATRIX_FLOAT64));
+        if (exact == NULL) {
+            printf("An Error Has Occurred\n");
+            exit(1);
+        }
+        approximation_error(exact, result, &max_error, &relative_error);
+        fprintf(stderr, "nystrom %d landmarks (rank %d): max error %g, relative frobenius error %g\n",
+                landmarks, result->layout == MATRIX_LOW_RANK ? result->rank : landmarks, max_error, relative_error);
+        free_matrix(exact);
+    }
+
+    /* What the cutoff left out goes to stderr, stdout only holds the matrix */
+    if (knn <= 0 && cutoff > 0) {
+        fprintf(stderr, "cutoff %g: kept %lu cells, dropped %lu, row sum error <= %g (relative <= %g), "
+                "frobenius error <= %g\n", cutoff, (unsigned long)report.kept, (unsigned long)report.dropped,
+                report.max_row_error, report.max_relative_row_error, report.frobenius_error);
+    }
+
+    /* Print the result matrix, unless it went to a matrix file (it may not fit in memory, let alone on a screen) */
+    if (result->mapped_bytes == 0) {
+        print_matrix(result);
+    }
     /* Free memory */
-    free_matrix(result, n);
-    free_matrix(X, n);
+    free_matrix(result);
+    free_matrix(X);
     return 0;
 }
@@ -1,10 +1,31 @@
 #ifndef SYMNMF_H
 #define SYMNMF_H
 
-void free_matrix(double** A, int n);
-double** sym_c(double** X, int n, int d);
-double** ddg_c(double** X, int n, int d);
-double** norm_c(double** X, int n, int d);
-double** symnmf_c(double** H_0, double** W, int n, int k);
+#include "matrix.h"
+#include "graph.h"
+
+/* Default convergence threshold and number of iterations of symnmf_c */
+extern const double EPSILON;
+extern const int MAX_ITER;
+
+matrix* sym_c(const matrix* X, matrix_layout layout, matrix_dtype dtype);
+matrix* ddg_c(const matrix* X);
+matrix* norm_c(const matrix* X, matrix_layout layout, matrix_dtype dtype);
+matrix* sym_file_c(const matrix* X, const char* path);
+matrix* norm_file_c(const matrix* X, const char* path);
+matrix* sym_knn_c(const matrix* X, int knn);
+matrix* ddg_knn_c(const matrix* X, int knn);
+matrix* norm_knn_c(const matrix* X, int knn);
+matrix* sym_cutoff_c(const matrix* X, double cutoff, truncation_report* report);
+matrix* ddg_cutoff_c(const matrix* X, double cutoff, truncation_report* report);
+matrix* norm_cutoff_c(const matrix* X, double cutoff, truncation_report* report);
+matrix* sym_nystrom_c(const matrix* X, int landmarks);
+matrix* ddg_nystrom_c(const matrix* X, int landmarks);
+matrix* norm_nystrom_c(const matrix* X, int landmarks);
+matrix* init_H_c(const matrix* W, int k, unsigned long seed);
+matrix* symnmf_c(const matrix* H_0, const matrix* W);
+matrix* symnmf_fit_c(const matrix* H_0, const matrix* W, double tol, int max_iter);
+matrix* symnmf_restarts_c(const matrix* H_0, const matrix* W, int restarts, double tol, int max_iter,
+                          double* objectives, int* best);
 
 #endif
\ No newline at end of file
@@ -2,17 +2,24 @@ import sys
 import symnmf_module
 import numpy as np
 import math
+import struct
 
 np.random.seed(1234)
 
+# A matrix file is a header page followed by the values (see storage.h)
+MATRIX_FILE_MAGIC = b"SYMNMFMX"
+MATRIX_FILE_HEADER = 4096
+MATRIX_FILE_BYTE_ORDER = 0x01020304
+
 
 def init_H(W, k):
     """
     Initialize a random matrix H, of size n x k
-    W: normalized similarity matrix
+    W: normalized similarity matrix (a Matrix from symnmf_module, an array or lists)
     k: number of clusters
     return: H
     """
+    W = np.asarray(W)
     n = len(W)
 
     # Calculate average entry of W
@@ -31,12 +38,45 @@ def init_H(W, k):
     return H
 
 
+def is_matrix_file(file_name):
+    """
+    Check whether a file is a matrix file, anything else is read as CSV
+    file_name: file to check
+    return: True for a matrix file
+    """
+    try:
+        with open(file_name, "rb") as f:
+            return f.read(len(MATRIX_FILE_MAGIC)) == MATRIX_FILE_MAGIC
+    except OSError:
+        return False
+
+
+def read_matrix_file(file_name):
+    """
+    Map a matrix file as a numpy array, without reading it
+    file_name: matrix file to map
+    return: X, read-only array backed by the file
+    """
+    with open(file_name, "rb") as f:
+        _, byte_order, dtype, layout, n, d = struct.unpack("=8s5I", f.read(28))
+
+    # Only dense float64 files written on a machine of the same byte order can be used as they are
+    if byte_order != MATRIX_FILE_BYTE_ORDER or dtype != 0 or layout != 0:
+        print("An Error Has Occurred")
+        sys.exit(1)
+
+    return np.memmap(file_name, dtype=np.float64, mode="r", offset=MATRIX_FILE_HEADER, shape=(n, d))
+
+
 def proccess_input_file(file_name):
     """
     Proccess and input file
     file_name: file to load input from
-    return: X, matrix read from file
+    return: X, matrix read from file (for a matrix file its path, the C module maps it without copying)
     """
+    if is_matrix_file(file_name):
+        return file_name
+
     # Open the file and check for errors
     try:
         f = open(file_name, "r")
@@ -68,8 +108,14 @@ def print_matrix(A):
     Print matrix A
     A: matrix to print
     """
-    for row in A:
-        print(",".join([f"{value:.4f}" for value in row]))
+    # The C module formats the cells (as "%.4f") and writes them straight to stdout
+    sys.stdout.flush()
+    try:
+        fd = sys.stdout.fileno()
+    except (AttributeError, OSError):
+        sys.stdout.write(symnmf_module.format(A).decode())
+        return
+    symnmf_module.format(A, fd=fd)
 
 
 def main():
@@ -2,68 +2,220 @@
 #include <Python.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "symnmf.h"
+#include "parallel.h"
+#include "storage.h"
+#include "csv.h"
+#include "simd.h"
 
 
-static double** build_matrix_from_lists(PyObject *lst, int *n, int *m) {
-    /* Build a C matrix from a list passed from python */
-    PyObject* item_lst;
-    PyObject* item;
-    PyObject* index;
-    double** A;
+static matrix* build_matrix_from_lists(PyObject *lst) {
+    /* Build a C matrix from a list passed from python (any sequence of sequences of numbers) */
+    PyObject* rows;
+    PyObject* row;
+    PyObject** items;
+    matrix* A;
+    int n, m;
     int i, j;
 
-    /* Get length of list */
-    *n = PyObject_Length(lst);
-    /* Allocate matrix rows */
-    A = (double**)malloc(*n * sizeof(double*));
+    /* Get the rows, they all have the length of the first one */
+    rows = PySequence_Fast(lst, "An Error Has Occurred");
+    if (rows == NULL) {
+        return NULL;
+    }
+    n = (int)PySequence_Fast_GET_SIZE(rows);
+    m = n > 0 ? (int)PySequence_Length(PySequence_Fast_GET_ITEM(rows, 0)) : 0;
+    if (m < 0) {
+        Py_DECREF(rows);
+        return NULL;
+    }
+
+    /* Allocate matrix */
+    A = malloc_matrix(n, m);
     if (A == NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        Py_DECREF(rows);
         return NULL;
     }
-    
+
     /* Load matrix values from lst */
-    for (i = 0; i < *n; i++) {
-        index = PyLong_FromLong(i);
-        item_lst = PyObject_GetItem(lst, index);
-
-        /* Get length of row */
-        *m = PyObject_Length(item_lst);
-        /* Allocate row */
-        A[i] = (double*)malloc(*m * sizeof(double));
-        if (A[i] == NULL) {
-            PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    for (i = 0; i < n; i++) {
+        row = PySequence_Fast(PySequence_Fast_GET_ITEM(rows, i), "An Error Has Occurred");
+        if (row == NULL || PySequence_Fast_GET_SIZE(row) != m) {
+            Py_XDECREF(row);
+            Py_DECREF(rows);
+            free_matrix(A);
             return NULL;
         }
-        
+
         /* Load values from lst to row */
-        for (j = 0; j < *m; j++) {
-            index = PyLong_FromLong(j);
-            item = PyObject_GetItem(item_lst, index);
-            A[i][j] = PyFloat_AsDouble(item);
+        items = PySequence_Fast_ITEMS(row);
+        for (j = 0; j < m; j++) {
+            MATRIX_AT(A, i, j) = PyFloat_AsDouble(items[j]);
+        }
+        Py_DECREF(row);
+    }
+    Py_DECREF(rows);
+
+    /* A value that isn't a number */
+    if (PyErr_Occurred()) {
+        free_matrix(A);
+        return NULL;
+    }
+
+    return A;
+}
+
+
+static matrix* build_matrix_from_buffer(PyObject *X, matrix_dtype dtype, Py_buffer *view) {
+    /* Build a C matrix of element type dtype over a 2D float64, float32 or float16 buffer with contiguous rows (a
+    numpy array or a slice of its rows, a memoryview, a Matrix). A buffer of that type is read without copying,
+    the matrix reads the buffer held in view until release_input; any other is converted into a new matrix
+    and released right away. NULL (and view->obj NULL) if X has no such buffer */
+
+    matrix* A;
+    matrix* cells;
+    const char* format;
+    Py_ssize_t itemsize, row_bytes;
+
+    view->obj = NULL;
+    if (!PyObject_CheckBuffer(X) || PyObject_GetBuffer(X, view, PyBUF_RECORDS_RO) != 0) {
+        PyErr_Clear();
+        view->obj = NULL;
+        return NULL;
+    }
+
+    /* Native byte order only, '@' and '=' say so explicitly */
+    format = view->format != NULL ? view->format : "B";
+    if (*format == '@' || *format == '=') {
+        format++;
+    }
+
+    /* Rows may be apart (a Matrix pads them), the cells of a row must be next to each other */
+    itemsize = view->itemsize;
+    row_bytes = view->ndim != 2 ? 0 : (view->strides != NULL ? view->strides[0] : view->shape[1] * itemsize);
+    if (view->ndim != 2 || view->shape[0] > 0x7fffffff || view->shape[1] > 0x7fffffff ||
+        (strcmp(format, "d") != 0 && strcmp(format, "f") != 0 && strcmp(format, "e") != 0) ||
+        (view->strides != NULL && view->strides[1] != itemsize) || row_bytes < view->shape[1] * itemsize ||
+        row_bytes % itemsize != 0) {
+        PyBuffer_Release(view);
+        view->obj = NULL;
+        return NULL;
+    }
+
+    /* Read the cells through a matrix header of their type over the buffer, kept if that is the type asked for */
+    cells = wrap_matrix((double*)view->buf, (int)view->shape[0], (int)view->shape[1],
+                        (size_t)(row_bytes / itemsize));
+    A = NULL;
+    if (cells != NULL) {
+        cells->dtype = strcmp(format, "d") == 0 ? MATRIX_FLOAT64 :
+                       (strcmp(format, "f") == 0 ? MATRIX_FLOAT32 : MATRIX_FLOAT16);
+        if (cells->dtype == dtype) {
+            return cells;
         }
+        A = convert_matrix(cells, dtype);
+        free_matrix(cells);
     }
+    PyBuffer_Release(view);
+    view->obj = NULL;
+
+    return A;
+}
+
+
+static matrix* build_matrix_from_input(PyObject *X, matrix_dtype dtype, Py_buffer *view) {
+    /* Build the C matrix of a dense matrix passed from python: a str is the path of a dense matrix file that
+    is mapped and a buffer of element type dtype is used as it is, both without copying; other buffers are
+    converted to dtype and anything else is read as float64 lists. Sets a python error and returns NULL if X
+    is none of them (a packed matrix file included), or there isn't enough memory */
+
+    matrix* A;
+    const char* path;
+
+    view->obj = NULL;
+    if (PyUnicode_Check(X)) {
+        path = PyUnicode_AsUTF8(X);
+        A = path != NULL ? map_matrix_file(path) : NULL;
+        if (A != NULL && A->layout != MATRIX_DENSE) {
+            free_matrix(A);
+            A = NULL;
+        }
+    }
+    else if ((A = build_matrix_from_buffer(X, dtype, view)) == NULL) {
+        A = build_matrix_from_lists(X);
+    }
+
+    if (A == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+
     return A;
 }
 
 
-static PyObject* build_lists_from_matrix(double** A, int n, int m) {
-    /* Build a lst to pass to python from C matrix of size n x m */
+static void release_input(matrix* A, Py_buffer *view) {
+    /* Free a matrix built by build_matrix_from_input, and give back the buffer it read */
+
+    free_matrix(A);
+    if (view->obj != NULL) {
+        PyBuffer_Release(view);
+    }
+}
+
+
+static matrix* build_packed_from_input(PyObject *W) {
+    /* Build a packed C matrix from a symmetric matrix passed from python, only its upper triangle is read */
+    Py_buffer view;
+    matrix* dense;
+    matrix* A;
+    int i;
+
+    dense = build_matrix_from_input(W, MATRIX_FLOAT64, &view);
+    if (dense == NULL) {
+        return NULL;
+    }
+    if (dense->rows != dense->cols) {
+        release_input(dense, &view);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    /* Allocate matrix */
+    A = malloc_packed(dense->rows);
+    if (A == NULL) {
+        release_input(dense, &view);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    /* Copy the cells from the main diagonal on of every row */
+    for (i = 0; i < A->rows; i++) {
+        memcpy(MATRIX_PACKED_ROW(A, i), MATRIX_ROW(dense, i) + i, (size_t)(A->cols - i) * sizeof(double));
+    }
+
+    release_input(dense, &view);
+
+    return A;
+}
+
+
+static PyObject* build_lists_from_matrix(const matrix* A) {
+    /* Build a lst to pass to python from C matrix of size n x m, of any layout */
     PyObject* lists;
     PyObject* lst;
     PyObject* item;
     int i, j;
 
-    lists = PyList_New(n);
+    lists = PyList_New(A->rows);
 
     /* For row of matrix */
-    for (i = 0; i < n; i++) {
-        lst = PyList_New(m);
+    for (i = 0; i < A->rows; i++) {
+        lst = PyList_New(A->cols);
 
         /* For value of row */
-        for (j = 0; j < m; j++) {
-            item = Py_BuildValue("d", A[i][j]);
+        for (j = 0; j < A->cols; j++) {
+            item = Py_BuildValue("d", matrix_get(A, i, j));
             PyList_SetItem(lst, j, item);
         }
 
@@ -74,148 +226,1432 @@ static PyObject* build_lists_from_matrix(double** A, int n, int m) {
 }
 
 
-static PyObject* sym(PyObject *self, PyObject *args) {
-    /* C module function to call sym_c */
-    double** X;
+/* A dense C matrix handed to python as it is: the object owns the matrix and exports its cells through the
+buffer protocol, so numpy.asarray (or memoryview) reads them without a copy. A matrix that belongs to another
+object (the cached W of a Solver) is exported read-only and keeps that object alive instead */
+typedef struct {
+    PyObject_HEAD
+    matrix* A;
+    PyObject* owner; /* NULL if the object owns A */
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} matrix_object;
+
+/* The Matrix type, created when the module is loaded */
+static PyTypeObject* matrix_type = NULL;
+
+
+static void matrix_object_dealloc(PyObject *self) {
+    /* Free the matrix along with the object */
+    PyTypeObject* type;
+
+    type = Py_TYPE(self);
+    if (((matrix_object*)self)->owner != NULL) {
+        Py_DECREF(((matrix_object*)self)->owner);
+    }
+    else {
+        free_matrix(((matrix_object*)self)->A);
+    }
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+
+static size_t element_size(matrix_dtype dtype) {
+    /* Number of bytes of a cell of a Matrix */
+
+    if (dtype == MATRIX_FLOAT32) {
+        return sizeof(float);
+    }
+    if (dtype == MATRIX_FLOAT16) {
+        return sizeof(unsigned short);
+    }
+
+    return sizeof(double);
+}
+
+
+static char* element_format(matrix_dtype dtype) {
+    /* struct module format of a cell of a Matrix */
+
+    if (dtype == MATRIX_FLOAT32) {
+        return "f";
+    }
+    if (dtype == MATRIX_FLOAT16) {
+        return "e";
+    }
+
+    return "d";
+}
+
+
+static int matrix_object_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+    /* Export the cells as a 2D float64 (or float32, float16) buffer. Padded rows are only readable with
+    strides */
+    matrix_object* object;
+    size_t size;
+    int contiguous;
+
+    object = (matrix_object*)self;
+    contiguous = object->A->stride == (size_t)object->A->cols || object->A->rows <= 1;
+
+    if (!contiguous && ((flags & PyBUF_STRIDES) != PyBUF_STRIDES ||
+                        (flags & PyBUF_C_CONTIGUOUS) == PyBUF_C_CONTIGUOUS ||
+                        (flags & PyBUF_ANY_CONTIGUOUS) == PyBUF_ANY_CONTIGUOUS)) {
+        PyErr_SetString(PyExc_BufferError, "matrix rows are padded, strides are needed to read them");
+        view->obj = NULL;
+        return -1;
+    }
+    if ((flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS && object->A->rows > 1 && object->A->cols > 1) {
+        PyErr_SetString(PyExc_BufferError, "matrix is row-major");
+        view->obj = NULL;
+        return -1;
+    }
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE && object->owner != NULL) {
+        PyErr_SetString(PyExc_BufferError, "matrix is cached by a Solver, it is read-only");
+        view->obj = NULL;
+        return -1;
+    }
+
+    size = element_size(object->A->dtype);
+    view->buf = object->A->data;
+    view->obj = self;
+    Py_INCREF(self);
+    view->len = (Py_ssize_t)object->A->rows * object->A->cols * (Py_ssize_t)size;
+    view->itemsize = (Py_ssize_t)size;
+    view->readonly = object->owner != NULL;
+    view->format = (flags & PyBUF_FORMAT) == PyBUF_FORMAT ? element_format(object->A->dtype) : NULL;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? object->shape : NULL;
+    view->ndim = view->shape != NULL ? 2 : 1; /* without shape, a PyBUF_SIMPLE request sees len plain bytes */
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? object->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+
+static PyType_Slot matrix_slots[] = {
+    {Py_tp_dealloc, (void*)matrix_object_dealloc},
+    {Py_bf_getbuffer, (void*)matrix_object_getbuffer},
+    {Py_tp_doc, (void*)PyDoc_STR("C matrix result (float64, or float32 / float16 for single / half precision), "
+                                 "read it with numpy.asarray or memoryview")},
+    {0, NULL}
+};
+
+
+static PyType_Spec matrix_spec = {
+    "symnmf_module.Matrix",
+    sizeof(matrix_object),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    matrix_slots
+};
+
+
+static PyObject* build_matrix_object(matrix* A, PyObject* owner) {
+    /* Wrap a dense C matrix in a Matrix, which frees it, or if owner isn't NULL keeps owner alive while it
+    reads A */
+    matrix_object* object;
+    size_t size;
+
+    object = PyObject_New(matrix_object, matrix_type);
+    if (object == NULL) {
+        return NULL;
+    }
+
+    object->A = A;
+    object->owner = owner;
+    Py_XINCREF(owner);
+    object->shape[0] = A->rows;
+    object->shape[1] = A->cols;
+    size = element_size(A->dtype);
+    object->strides[0] = (Py_ssize_t)(A->stride * size);
+    object->strides[1] = (Py_ssize_t)size;
+
+    return (PyObject*)object;
+}
+
+
+static PyObject* build_output(matrix** A, int wants_lists) {
+    /* Build the python result of a C matrix of any layout: nested lists if they are asked for, otherwise a
+    Matrix. A dense matrix is moved into the Matrix (*A becomes NULL), other layouts (and bfloat16, which has
+    no buffer format) are expanded into a dense float64 copy first; whatever is left in *A is still the
+    caller's to free */
+    PyObject* object;
+    matrix* dense;
+    int i, j;
+
+    if (wants_lists) {
+        return build_lists_from_matrix(*A);
+    }
+
+    if ((*A)->layout == MATRIX_DENSE && (*A)->dtype != MATRIX_BFLOAT16) {
+        dense = *A;
+    }
+    else {
+        dense = malloc_matrix((*A)->rows, (*A)->cols);
+        if (dense == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+            return NULL;
+        }
+        for (i = 0; i < dense->rows; i++) {
+            for (j = 0; j < dense->cols; j++) {
+                MATRIX_AT(dense, i, j) = matrix_get(*A, i, j);
+            }
+        }
+    }
+
+    object = build_matrix_object(dense, NULL);
+    if (object == NULL) {
+        if (dense != *A) {
+            free_matrix(dense);
+        }
+        return NULL;
+    }
+
+    if (dense == *A) {
+        *A = NULL;
+    }
+
+    return object;
+}
+
+
+static matrix* build_csr_from_tuple(PyObject *csr) {
+    /* Build a sparse square C matrix from a (data, indices, indptr) tuple of lists passed from python, the
+    layout scipy.sparse.csr_matrix takes. Sets a python error and returns NULL unless indices has a column in
+    [0, n) for every cell of data and indptr is n + 1 offsets from 0 up to the number of cells, never
+    decreasing */
+    PyObject* data;
+    PyObject* indices;
+    PyObject* indptr;
+    PyObject* data_seq;
+    PyObject* indices_seq;
+    PyObject* indptr_seq;
+    matrix* A;
+    Py_ssize_t nonzeros, offset, column;
+    int n;
+    int i;
+    Py_ssize_t p;
+
+    if (!PyArg_ParseTuple(csr, "OOO", &data, &indices, &indptr)) {
+        return NULL;
+    }
+
+    data_seq = PySequence_Fast(data, "An Error Has Occurred");
+    indices_seq = data_seq != NULL ? PySequence_Fast(indices, "An Error Has Occurred") : NULL;
+    indptr_seq = indices_seq != NULL ? PySequence_Fast(indptr, "An Error Has Occurred") : NULL;
+
+    /* Get dimensions, indptr has a cell more than the matrix has rows */
+    A = NULL;
+    if (indptr_seq != NULL && PySequence_Fast_GET_SIZE(indptr_seq) >= 1 &&
+        PySequence_Fast_GET_SIZE(indptr_seq) - 1 <= 0x7fffffff &&
+        PySequence_Fast_GET_SIZE(indices_seq) == PySequence_Fast_GET_SIZE(data_seq)) {
+        n = (int)(PySequence_Fast_GET_SIZE(indptr_seq) - 1);
+        nonzeros = PySequence_Fast_GET_SIZE(data_seq);
+        A = malloc_csr(n, n, (size_t)nonzeros);
+    }
+
+    /* Load the row offsets, then the cells and their columns, stopping at the first one out of range */
+    for (i = 0; A != NULL && i <= A->rows; i++) {
+        offset = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(indptr_seq, i));
+        if (PyErr_Occurred() || offset < (i == 0 ? 0 : (Py_ssize_t)A->offsets[i - 1]) || offset > nonzeros ||
+            (i == 0 && offset != 0) || (i == A->rows && offset != nonzeros)) {
+            free_matrix(A);
+            A = NULL;
+            break;
+        }
+        A->offsets[i] = (size_t)offset;
+    }
+    for (p = 0; A != NULL && p < nonzeros; p++) {
+        ((double*)A->data)[p] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(data_seq, p));
+        column = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(indices_seq, p));
+        if (PyErr_Occurred() || column < 0 || column >= A->rows) {
+            free_matrix(A);
+            A = NULL;
+            break;
+        }
+        A->indices[p] = (int)column;
+    }
+
+    Py_XDECREF(data_seq);
+    Py_XDECREF(indices_seq);
+    Py_XDECREF(indptr_seq);
+
+    if (A == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+
+    return A;
+}
+
+
+static PyObject* build_tuple_from_csr(const matrix* A) {
+    /* Build a (data, indices, indptr) tuple of lists to pass to python from a sparse C matrix. Returns NULL
+    with the python error set if an object can't be allocated */
+    PyObject* data;
+    PyObject* indices;
+    PyObject* indptr;
+    PyObject* item;
+    size_t p;
+    int i;
+    int failed;
+
+    data = PyList_New((Py_ssize_t)A->offsets[A->rows]);
+    indices = PyList_New((Py_ssize_t)A->offsets[A->rows]);
+    indptr = PyList_New(A->rows + 1);
+    failed = data == NULL || indices == NULL || indptr == NULL;
+
+    for (i = 0; !failed && i <= A->rows; i++) {
+        failed = (item = PyLong_FromSize_t(A->offsets[i])) == NULL || PyList_SetItem(indptr, i, item) != 0;
+    }
+    for (p = 0; !failed && p < A->offsets[A->rows]; p++) {
+        failed = (item = PyFloat_FromDouble(((const double*)A->data)[p])) == NULL ||
+                 PyList_SetItem(data, (Py_ssize_t)p, item) != 0 ||
+                 (item = PyLong_FromLong(A->indices[p])) == NULL ||
+                 PyList_SetItem(indices, (Py_ssize_t)p, item) != 0;
+    }
+
+    /* Give back the lists built so far, the cells missing from them are NULL */
+    if (failed) {
+        Py_XDECREF(data);
+        Py_XDECREF(indices);
+        Py_XDECREF(indptr);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NNN)", data, indices, indptr);
+}
+
+
+static matrix* build_low_rank_from_tuple(PyObject *low_rank) {
+    /* Build a low rank C matrix G * G^t - diag(c) from a (G, c) tuple of lists passed from python. Sets a python
+    error and returns NULL unless every row of G has the length of the first one, c has a number for every
+    row and all of them are numbers */
+    PyObject* factor;
+    PyObject* diagonal;
+    PyObject* rows;
+    PyObject* row;
+    PyObject* cells;
+    PyObject** items;
+    matrix* A;
+    int n, rank;
+    int i, p;
+
+    if (!PyArg_ParseTuple(low_rank, "OO", &factor, &diagonal)) {
+        return NULL;
+    }
+
+    rows = PySequence_Fast(factor, "An Error Has Occurred");
+    cells = rows != NULL ? PySequence_Fast(diagonal, "An Error Has Occurred") : NULL;
+
+    /* Get dimensions of the factor, rows all have the length of the first one */
+    A = NULL;
+    if (cells != NULL && PySequence_Fast_GET_SIZE(rows) <= 0x7fffffff &&
+        PySequence_Fast_GET_SIZE(cells) == PySequence_Fast_GET_SIZE(rows)) {
+        n = (int)PySequence_Fast_GET_SIZE(rows);
+        rank = n > 0 ? (int)PySequence_Length(PySequence_Fast_GET_ITEM(rows, 0)) : 0;
+        A = rank >= 0 ? malloc_low_rank(n, rank) : NULL;
+    }
+
+    /* Load the factor row by row, then the diagonal */
+    for (i = 0; A != NULL && i < A->rows; i++) {
+        row = PySequence_Fast(PySequence_Fast_GET_ITEM(rows, i), "An Error Has Occurred");
+        if (row == NULL || PySequence_Fast_GET_SIZE(row) != A->rank) {
+            Py_XDECREF(row);
+            free_matrix(A);
+            A = NULL;
+            break;
+        }
+
+        items = PySequence_Fast_ITEMS(row);
+        for (p = 0; p < A->rank; p++) {
+            MATRIX_AT(A, i, p) = PyFloat_AsDouble(items[p]);
+        }
+        Py_DECREF(row);
+
+        MATRIX_LOW_RANK_DIAGONAL(A)[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(cells, i));
+    }
+
+    Py_XDECREF(rows);
+    Py_XDECREF(cells);
+
+    /* A row or length that doesn't fit, or a value that isn't a number */
+    if (A != NULL && PyErr_Occurred()) {
+        free_matrix(A);
+        A = NULL;
+    }
+    if (A == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+
+    return A;
+}
+
+
+static PyObject* build_tuple_from_low_rank(const matrix* A) {
+    /* Build a (G, c) tuple of lists to pass to python from a low rank C matrix G * G^t - diag(c). Returns NULL
+    with the python error set if an object can't be allocated */
+    PyObject* factor;
+    PyObject* diagonal;
+    PyObject* row;
+    PyObject* item;
+    int i, p;
+    int failed;
+
+    factor = PyList_New(A->rows);
+    diagonal = PyList_New(A->rows);
+    failed = factor == NULL || diagonal == NULL;
+
+    for (i = 0; !failed && i < A->rows; i++) {
+        failed = (row = PyList_New(A->rank)) == NULL || PyList_SetItem(factor, i, row) != 0;
+        for (p = 0; !failed && p < A->rank; p++) {
+            failed = (item = PyFloat_FromDouble(MATRIX_AT(A, i, p))) == NULL || PyList_SetItem(row, p, item) != 0;
+        }
+
+        failed = failed || (item = PyFloat_FromDouble(MATRIX_LOW_RANK_DIAGONAL(A)[i])) == NULL ||
+                 PyList_SetItem(diagonal, i, item) != 0;
+    }
+
+    /* Give back the lists built so far, the cells missing from them are NULL */
+    if (failed) {
+        Py_XDECREF(factor);
+        Py_XDECREF(diagonal);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NN)", factor, diagonal);
+}
+
+
+static matrix* build_W_from_input(PyObject *W, int packed, matrix_dtype dtype, Py_buffer *view) {
+    /* Build the C matrix of a normalized similarity matrix passed from python: a sparse (data, indices, indptr)
+    tuple, a low rank (G, c) tuple, the path of a matrix file (mapped, a packed file is streamed from disk by
+    every product) or a dense matrix, stored packed if asked for. A dense matrix is stored in element type
+    dtype, a buffer already of that type without a copy; the other layouts are only double. Sets a python
+    error and returns NULL if W is none of them */
+    matrix* A;
+    matrix* converted;
+    const char* path;
+
+    view->obj = NULL;
+    if (PyTuple_Check(W)) {
+        A = PyTuple_Size(W) == 2 ? build_low_rank_from_tuple(W) : build_csr_from_tuple(W);
+    }
+    else if (PyUnicode_Check(W)) { /* dense or packed, unlike any other matrix file input */
+        path = PyUnicode_AsUTF8(W);
+        A = path != NULL ? map_matrix_file(path) : NULL;
+    }
+    else {
+        A = packed ? build_packed_from_input(W) : build_matrix_from_input(W, dtype, view);
+    }
+
+    if (A != NULL && dtype != A->dtype) {
+        converted = A->layout == MATRIX_DENSE ? convert_matrix(A, dtype) : NULL;
+        release_input(A, view);
+        A = converted;
+    }
+
+    if (A == NULL && !PyErr_Occurred()) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+
+    return A;
+}
+
+
+static PyObject* build_dict_from_report(const truncation_report* report) {
+    /* Build a dict to pass to python from a truncation report */
+
+    return Py_BuildValue("{s:n,s:n,s:d,s:d,s:d}",
+                         "kept", (Py_ssize_t)report->kept,
+                         "dropped", (Py_ssize_t)report->dropped,
+                         "max_row_error", report->max_row_error,
+                         "max_relative_row_error", report->max_relative_row_error,
+                         "frobenius_error", report->frobenius_error);
+}
+
+
+static PyObject* with_report(PyObject* result, int wanted, const truncation_report* report) {
+    /* Pair a result with its truncation report if it was asked for */
+
+    if (!wanted || result == NULL) {
+        return result;
+    }
+
+    return Py_BuildValue("(NN)", result, build_dict_from_report(report));
+}
+
+
+static PyObject* with_error(PyObject* result, int wanted, matrix* exact, const matrix* approximation) {
+    /* Pair a result with how far it is from the exact matrix if it was asked for, exact is freed */
+
+    double max_error, relative_error;
+
+    if (!wanted || result == NULL) {
+        free_matrix(exact);
+        return result;
+    }
+
+    approximation_error(exact, approximation, &max_error, &relative_error);
+    free_matrix(exact);
+
+    return Py_BuildValue("(N{s:d,s:d})", result, "max_error", max_error, "relative_error", relative_error);
+}
+
+
+static PyObject* sym(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* C module function to call sym_c, or sym_knn_c / sym_cutoff_c / sym_nystrom_c if knn / cutoff / landmarks
+    is given */
+    static char* keywords[] = {"X", "packed", "threads", "knn", "cutoff", "report", "landmarks", "file", "lists",
+                               "precision", NULL};
+    matrix* X;
+    matrix* result;
+    matrix* exact;
+    Py_buffer X_view;
     PyObject* X_lst;
     PyObject* lists;
-    int n, d;
+    truncation_report report;
+    const char* path;
+    const char* precision;
+    matrix_dtype dtype;
+    int packed, threads, knn, wants_report, landmarks, wants_lists;
+    double cutoff;
 
-    /* Get 2D list from python */
-    if (!PyArg_ParseTuple(args, "O", &X_lst)) {
+    /* Get 2D list (or the path of a matrix file, or a float64 / float32 buffer) from python, whether the result should
+    be stored packed on the C side, the number of threads (0 for SYMNMF_NUM_THREADS or every core), the number of
+    neighbors of the sparse graph, the cutoff under which cells are left out or the number of Nystrom landmarks (0
+    for the full matrix), whether the truncation report of the cutoff (or the error of the Nystrom approximation)
+    should be returned too, the matrix file the result should be written to instead of returned, whether a
+    dense result should come back as nested lists instead of a Matrix and the precision of a dense result
+    ("double", "single", "half" or "bfloat16") */
+    path = NULL;
+    precision = NULL;
+    dtype = MATRIX_FLOAT64;
+    packed = 0;
+    threads = 0;
+    knn = 0;
+    cutoff = 0;
+    wants_report = 0;
+    landmarks = 0;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|piidpizpz", keywords, &X_lst, &packed, &threads, &knn,
+                                     &cutoff, &wants_report, &landmarks, &path, &wants_lists, &precision) ||
+        cutoff < 0 || cutoff >= 1 ||
+        (path != NULL && (knn > 0 || cutoff > 0 || landmarks > 0)) ||
+        (precision != NULL && matrix_dtype_from_name(precision, &dtype) != 0) ||
+        (dtype != MATRIX_FLOAT64 && (packed || path != NULL || knn > 0 || cutoff > 0 || landmarks > 0))) {
         PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
         return NULL;
     }
+    parallel_set_threads(threads);
 
-    /* Make C matrix from python list */
-    X = build_matrix_from_lists(X_lst, &n, &d);
+    /* Make C matrix from python list (or matrix file, or buffer) */
+    X = build_matrix_from_input(X_lst, MATRIX_FLOAT64, &X_view);
+    if (X == NULL) {
+        return NULL;
+    }
 
-    /* Call sym_c function */
-    double** result = sym_c(X, n, d);
+    /* Call sym_c function without the GIL, X (and the buffer it reads) stays held until release_input */
+    exact = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    if (knn > 0) {
+        result = sym_knn_c(X, knn);
+    }
+    else if (cutoff > 0) {
+        result = sym_cutoff_c(X, cutoff, &report);
+    }
+    else if (landmarks > 0) {
+        result = sym_nystrom_c(X, landmarks);
+        exact = wants_report && result != NULL ? sym_c(X, MATRIX_DENSE, MATRIX_FLOAT64) : NULL;
+    }
+    else if (path != NULL) {
+        result = sym_file_c(X, path);
+    }
+    else {
+        result = sym_c(X, packed ? MATRIX_PACKED : MATRIX_DENSE, dtype);
+    }
+    Py_END_ALLOW_THREADS
 
-    /* Build python-passable list from result */
-    lists = build_lists_from_matrix(result, n, n);
+    /* Not enough memory (or room for the matrix file) */
+    if (result == NULL || (landmarks > 0 && wants_report && exact == NULL)) {
+        release_input(X, &X_view);
+        free_matrix(result);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    /* Hand the result to python, the sparse graph as a (data, indices, indptr) tuple */
+    if (knn > 0) {
+        lists = build_tuple_from_csr(result);
+    }
+    else if (cutoff > 0) {
+        lists = with_report(build_tuple_from_csr(result), wants_report, &report);
+    }
+    else if (landmarks > 0) {
+        lists = with_error(build_tuple_from_low_rank(result), wants_report, exact, result);
+    }
+    else if (path != NULL) { /* the file is all that is returned, the matrix may not fit in memory */
+        lists = PyUnicode_FromString(path);
+    }
+    else {
+        lists = build_output(&result, wants_lists);
+    }
 
     /* Free memory */
-    free_matrix(X, n);
-    free_matrix(result, n);
+    release_input(X, &X_view);
+    free_matrix(result);
 
     return lists;
 }
 
 
-static PyObject* ddg(PyObject *self, PyObject *args) {
-    /* C module function to call ddg_c */
-    double** X;
+static PyObject* ddg(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* C module function to call ddg_c, or ddg_knn_c / ddg_cutoff_c / ddg_nystrom_c if knn / cutoff / landmarks
+    is given */
+    static char* keywords[] = {"X", "threads", "knn", "cutoff", "report", "landmarks", "lists", NULL};
+    matrix* X;
+    matrix* result;
+    matrix* exact;
+    Py_buffer X_view;
     PyObject* X_lst;
     PyObject* lists;
-    int n, d;
+    truncation_report report;
+    int threads, knn, wants_report, landmarks, wants_lists;
+    double cutoff;
 
-    /* Get 2D list from python */
-    if (!PyArg_ParseTuple(args, "O", &X_lst)) {
+    /* Get 2D list (or the path of a matrix file, or a float64 / float32 buffer) from python, the number of threads (0
+    for SYMNMF_NUM_THREADS or every core), the number of neighbors of the sparse graph, the cutoff under which cells
+    are left out or the number of Nystrom landmarks (0 for the full matrix) and whether the truncation report of the
+    cutoff (or the error of the Nystrom approximation) should be returned too and whether the result should come
+    back as nested lists instead of a Matrix */
+    threads = 0;
+    knn = 0;
+    cutoff = 0;
+    wants_report = 0;
+    landmarks = 0;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iidpip", keywords, &X_lst, &threads, &knn, &cutoff,
+                                     &wants_report, &landmarks, &wants_lists) || cutoff < 0 || cutoff >= 1) {
         PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
         return NULL;
     }
+    parallel_set_threads(threads);
+
+    /* Make C matrix from python list (or matrix file, or buffer) */
+    X = build_matrix_from_input(X_lst, MATRIX_FLOAT64, &X_view);
+    if (X == NULL) {
+        return NULL;
+    }
 
-    /* Make C matrix from python list */
-    X = build_matrix_from_lists(X_lst, &n, &d);
+    /* Call ddg_c function without the GIL, X (and the buffer it reads) stays held until release_input */
+    exact = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    if (knn > 0) {
+        result = ddg_knn_c(X, knn);
+    }
+    else if (cutoff > 0) {
+        result = ddg_cutoff_c(X, cutoff, &report);
+    }
+    else if (landmarks > 0) {
+        result = ddg_nystrom_c(X, landmarks);
+        exact = wants_report && result != NULL ? ddg_c(X) : NULL;
+    }
+    else {
+        result = ddg_c(X);
+    }
+    Py_END_ALLOW_THREADS
 
-    /* Call ddg_c function */
-    double** result = ddg_c(X, n, d);
+    /* Not enough memory */
+    if (result == NULL || (landmarks > 0 && wants_report && exact == NULL)) {
+        release_input(X, &X_view);
+        free_matrix(result);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
 
-    /* Build python-passable list from result */
-    lists = build_lists_from_matrix(result, n, n);
+    /* Hand the result to python (as lists if asked for) */
+    if (knn > 0) {
+        lists = build_output(&result, wants_lists);
+    }
+    else if (cutoff > 0) {
+        lists = with_report(build_output(&result, wants_lists), wants_report, &report);
+    }
+    else if (landmarks > 0) {
+        lists = with_error(build_output(&result, wants_lists), wants_report, exact, result);
+    }
+    else {
+        lists = build_output(&result, wants_lists);
+    }
 
     /* Free memory */
-    free_matrix(X, n);
-    free_matrix(result, n);
+    release_input(X, &X_view);
+    free_matrix(result);
 
     return lists;
 }
 
 
-static PyObject* norm(PyObject *self, PyObject *args) {
-    /* C module function to call norm_c */
-    double** X;
+static PyObject* norm(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* C module function to call norm_c, or norm_knn_c / norm_cutoff_c / norm_nystrom_c if knn / cutoff / landmarks
+    is given */
+    static char* keywords[] = {"X", "packed", "threads", "knn", "cutoff", "report", "landmarks", "file", "lists",
+                               "precision", NULL};
+    matrix* X;
+    matrix* result;
+    matrix* exact;
+    Py_buffer X_view;
     PyObject* X_lst;
     PyObject* lists;
-    int n, d;
+    truncation_report report;
+    const char* path;
+    const char* precision;
+    matrix_dtype dtype;
+    int packed, threads, knn, wants_report, landmarks, wants_lists;
+    double cutoff;
 
-    /* Get 2D list from python */
-    if (!PyArg_ParseTuple(args, "O", &X_lst)) {
+    /* Get 2D list (or the path of a matrix file, or a float64 / float32 buffer) from python, whether the result should
+    be stored packed on the C side, the number of threads (0 for SYMNMF_NUM_THREADS or every core), the number of
+    neighbors of the sparse graph, the cutoff under which cells are left out or the number of Nystrom landmarks (0
+    for the full matrix), whether the truncation report of the cutoff (or the error of the Nystrom approximation)
+    should be returned too, the matrix file the result should be written to instead of returned, whether a
+    dense result should come back as nested lists instead of a Matrix and the precision of a dense result
+    ("double", "single", "half" or "bfloat16") */
+    path = NULL;
+    precision = NULL;
+    dtype = MATRIX_FLOAT64;
+    packed = 0;
+    threads = 0;
+    knn = 0;
+    cutoff = 0;
+    wants_report = 0;
+    landmarks = 0;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|piidpizpz", keywords, &X_lst, &packed, &threads, &knn,
+                                     &cutoff, &wants_report, &landmarks, &path, &wants_lists, &precision) ||
+        cutoff < 0 || cutoff >= 1 ||
+        (path != NULL && (knn > 0 || cutoff > 0 || landmarks > 0)) ||
+        (precision != NULL && matrix_dtype_from_name(precision, &dtype) != 0) ||
+        (dtype != MATRIX_FLOAT64 && (packed || path != NULL || knn > 0 || cutoff > 0 || landmarks > 0))) {
         PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
         return NULL;
     }
+    parallel_set_threads(threads);
+
+    /* Make C matrix from python list (or matrix file, or buffer) */
+    X = build_matrix_from_input(X_lst, MATRIX_FLOAT64, &X_view);
+    if (X == NULL) {
+        return NULL;
+    }
 
-    /* Make C matrix from python list */
-    X = build_matrix_from_lists(X_lst, &n, &d);
+    /* Call norm_c function without the GIL, X (and the buffer it reads) stays held until release_input */
+    exact = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    if (knn > 0) {
+        result = norm_knn_c(X, knn);
+    }
+    else if (cutoff > 0) {
+        result = norm_cutoff_c(X, cutoff, &report);
+    }
+    else if (landmarks > 0) {
+        result = norm_nystrom_c(X, landmarks);
+        exact = wants_report && result != NULL ? norm_c(X, MATRIX_DENSE, MATRIX_FLOAT64) : NULL;
+    }
+    else if (path != NULL) {
+        result = norm_file_c(X, path);
+    }
+    else {
+        result = norm_c(X, packed ? MATRIX_PACKED : MATRIX_DENSE, dtype);
+    }
+    Py_END_ALLOW_THREADS
 
-    /* Call norm_c function */
-    double** result = norm_c(X, n, d);
+    /* Not enough memory (or room for the matrix file) */
+    if (result == NULL || (landmarks > 0 && wants_report && exact == NULL)) {
+        release_input(X, &X_view);
+        free_matrix(result);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
 
-    /* Build python-passable list from result */
-    lists = build_lists_from_matrix(result, n, n);
+    /* Hand the result to python, the sparse graph as a (data, indices, indptr) tuple */
+    if (knn > 0) {
+        lists = build_tuple_from_csr(result);
+    }
+    else if (cutoff > 0) {
+        lists = with_report(build_tuple_from_csr(result), wants_report, &report);
+    }
+    else if (landmarks > 0) {
+        lists = with_error(build_tuple_from_low_rank(result), wants_report, exact, result);
+    }
+    else if (path != NULL) { /* the file is all that is returned, the matrix may not fit in memory */
+        lists = PyUnicode_FromString(path);
+    }
+    else {
+        lists = build_output(&result, wants_lists);
+    }
 
     /* Free memory */
-    free_matrix(X, n);
-    free_matrix(result, n);
+    release_input(X, &X_view);
+    free_matrix(result);
 
     return lists;
 }
 
 
-static PyObject* symnmf(PyObject *self, PyObject *args) {
+static PyObject* symnmf(PyObject *self, PyObject *args, PyObject *kwargs) {
     /* C module function to call symnmf_c */
-    double** H_0;
-    double** W;
-    double** result;
+    static char* keywords[] = {"H", "W", "packed", "threads", "lists", "precision", NULL};
+    matrix* H_0;
+    matrix* W;
+    matrix* result;
+    Py_buffer H_0_view;
+    Py_buffer W_view;
     PyObject* H_0_lst;
     PyObject* W_lst;
     PyObject* lists;
-    int n, k;
+    const char* precision;
+    matrix_dtype dtype;
+    int packed, threads, wants_lists;
+
+    /* Get two 2D lists (or float64 / float32 buffers) from python (W may also be a sparse (data, indices,
+    indptr) tuple, a low rank (G, c) tuple or the path of a matrix file), whether W should be stored packed on
+    the C side, the number of threads (0 for SYMNMF_NUM_THREADS or every core), whether the result should come
+    back as nested lists instead of a Matrix and the precision a dense W is stored in for W * H ("double", or
+    "single", "half" or "bfloat16", multiplied in floats) */
+    packed = 0;
+    threads = 0;
+    wants_lists = 0;
+    precision = NULL;
+    dtype = MATRIX_FLOAT64;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|pipz", keywords, &H_0_lst, &W_lst, &packed, &threads,
+                                     &wants_lists, &precision) ||
+        (precision != NULL && matrix_dtype_from_name(precision, &dtype) != 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    parallel_set_threads(threads);
+
+    /* Make C matrices from python lists (or buffers, used without copying) */
+    H_0 = build_matrix_from_input(H_0_lst, MATRIX_FLOAT64, &H_0_view);
+    if (H_0 == NULL) {
+        return NULL;
+    }
+    W = build_W_from_input(W_lst, packed, dtype, &W_view);
+    if (W == NULL) {
+        release_input(H_0, &H_0_view);
+        return NULL;
+    }
 
-    /* Get two 2D lists from python */
-    if (!PyArg_ParseTuple(args, "OO", &H_0_lst, &W_lst)) {
+    /* Buffers come with their own shapes, W must be square with a row of H_0 for every row of it */
+    if (W->rows != W->cols || H_0->rows != W->rows) {
+        release_input(H_0, &H_0_view);
+        release_input(W, &W_view);
         PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
         return NULL;
     }
 
-    /* Make C matrices from python lists */
-    H_0 = build_matrix_from_lists(H_0_lst, &n, &k);
-    W = build_matrix_from_lists(W_lst, &n, &n);
-    
-    /* Call symnmf_c function */
-    result = symnmf_c(H_0, W, n, k);
-    
-    /* Build python-passable list from result */
-    lists = build_lists_from_matrix(result, n, k);
-    
+    /* Call symnmf_c function without the GIL, H_0 and W (and the buffers they read) stay held until
+    release_input */
+    Py_BEGIN_ALLOW_THREADS
+    result = symnmf_c(H_0, W);
+    Py_END_ALLOW_THREADS
+
+    /* Hand the result to python (as lists if asked for), unless there wasn't enough memory for it */
+    if (result != NULL) {
+        lists = build_output(&result, wants_lists);
+    }
+    else {
+        lists = NULL;
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+
     /* Free memory */
-    free_matrix(H_0, n);
-    free_matrix(W, n);
-    free_matrix(result, n);
+    release_input(H_0, &H_0_view);
+    release_input(W, &W_view);
+    free_matrix(result);
 
     return lists;
 }
 
 
+static PyObject* format(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* C module function to call format_matrix, or write_matrix if a file descriptor is given */
+    static char* keywords[] = {"A", "fd", NULL};
+    matrix* A;
+    Py_buffer A_view;
+    PyObject* A_lst;
+    PyObject* text;
+    char* buffer;
+    size_t length;
+    int fd, failed;
+
+    /* Get 2D list (or the path of a matrix file, or a float64 / float32 buffer) from python and the file descriptor to
+    write the text to (-1 to get it back as bytes) */
+    fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", keywords, &A_lst, &fd)) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    /* Make C matrix from python list (or matrix file, or buffer) */
+    A = build_matrix_from_input(A_lst, MATRIX_FLOAT64, &A_view);
+    if (A == NULL) {
+        return NULL;
+    }
+
+    /* The same text the CLI prints, a line of "%.4f" cells per row. Formatting and writing (which may wait on
+    a pipe) happen without the GIL */
+    buffer = NULL;
+    failed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    if (fd >= 0) {
+        failed = write_matrix(A, fd) != 0;
+    }
+    else {
+        buffer = format_matrix(A, &length);
+        failed = buffer == NULL;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        text = NULL;
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+    else if (fd >= 0) {
+        text = Py_None;
+        Py_INCREF(text);
+    }
+    else {
+        text = PyBytes_FromStringAndSize(buffer, (Py_ssize_t)length);
+    }
+    free(buffer);
+
+    /* Free memory */
+    release_input(A, &A_view);
+
+    return text;
+}
+
+
+/* A normalized similarity matrix kept on the C side between calls: built once from X (which is kept too) or
+from W, in the layout asked for, so repeated fits (a sweep over k, several seeds) don't convert it again */
+typedef struct {
+    PyObject_HEAD
+    matrix* X; /* NULL for a solver built from W */
+    Py_buffer X_view;
+    matrix* W;
+    Py_buffer W_view;
+    matrix* D; /* the degrees, calculated by the first ddg() */
+    matrix_dtype dtype; /* of a dense W, and of what sym() returns */
+    int packed, threads, knn, landmarks;
+    double cutoff;
+} solver_object;
+
+/* The Solver type, created when the module is loaded */
+static PyTypeObject* solver_type = NULL;
+
+
+static PyObject* solver_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    /* Build a solver from X (W is calculated from it, like norm does) or from W (anything symnmf takes) */
+    static char* keywords[] = {"X", "W", "packed", "threads", "knn", "cutoff", "landmarks", "precision", NULL};
+    solver_object* self;
+    PyObject* X_lst;
+    PyObject* W_lst;
+    matrix* X;
+    matrix* W;
+    const char* precision;
+    matrix_dtype dtype;
+    int packed, threads, knn, landmarks;
+    double cutoff;
+
+    /* Get X or W (not both), whether W should be stored packed on the C side, the number of threads (0 for
+    SYMNMF_NUM_THREADS or every core), for X the number of neighbors of the sparse graph, the cutoff under
+    which cells are left out or the number of Nystrom landmarks (0 for the full matrix) and the precision a
+    dense W is stored in ("double", "single", "half" or "bfloat16") */
+    X_lst = Py_None;
+    W_lst = Py_None;
+    packed = 0;
+    threads = 0;
+    knn = 0;
+    cutoff = 0;
+    landmarks = 0;
+    precision = NULL;
+    dtype = MATRIX_FLOAT64;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOpiidiz", keywords, &X_lst, &W_lst, &packed, &threads,
+                                     &knn, &cutoff, &landmarks, &precision) ||
+        (X_lst == Py_None) == (W_lst == Py_None) || cutoff < 0 || cutoff >= 1 ||
+        (precision != NULL && matrix_dtype_from_name(precision, &dtype) != 0) ||
+        (dtype != MATRIX_FLOAT64 && (packed || knn > 0 || cutoff > 0 || landmarks > 0))) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    parallel_set_threads(threads);
+
+    self = (solver_object*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->X_view.obj = NULL;
+    self->W_view.obj = NULL;
+    self->dtype = dtype;
+    self->packed = packed;
+    self->threads = threads;
+    self->knn = knn;
+    self->cutoff = cutoff;
+    self->landmarks = landmarks;
+
+    /* From W it is only converted (or used as it is), X and the buffer it reads are kept for sym and ddg */
+    if (W_lst != Py_None) {
+        self->W = build_W_from_input(W_lst, packed, dtype, &self->W_view);
+    }
+    else if ((self->X = build_matrix_from_input(X_lst, MATRIX_FLOAT64, &self->X_view)) != NULL) {
+        X = self->X;
+        Py_BEGIN_ALLOW_THREADS
+        if (knn > 0) {
+            W = norm_knn_c(X, knn);
+        }
+        else if (cutoff > 0) {
+            W = norm_cutoff_c(X, cutoff, NULL);
+        }
+        else if (landmarks > 0) {
+            W = norm_nystrom_c(X, landmarks);
+        }
+        else {
+            W = norm_c(X, packed ? MATRIX_PACKED : MATRIX_DENSE, dtype);
+        }
+        Py_END_ALLOW_THREADS
+
+        self->W = W;
+        if (W == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        }
+    }
+
+    if (self->W == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject*)self;
+}
+
+
+static void solver_dealloc(PyObject *self) {
+    /* Free the cached matrices and give back the buffers they read */
+    solver_object* solver;
+    PyTypeObject* type;
+
+    solver = (solver_object*)self;
+    type = Py_TYPE(self);
+    release_input(solver->W, &solver->W_view);
+    release_input(solver->X, &solver->X_view);
+    free_matrix(solver->D);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+
+static PyObject* solver_fit(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* Run symnmf_c on the cached W from H (or from a random H for k clusters) */
+    static char* keywords[] = {"H", "seed", "tol", "max_iter", "lists", NULL};
+    solver_object* solver;
+    matrix* H_0;
+    matrix* result;
+    Py_buffer H_0_view;
+    PyObject* H_0_lst;
+    PyObject* lists;
+    unsigned long seed;
+    double tol;
+    long k;
+    int max_iter, wants_lists;
+
+    /* Get the initial H (2D list or float64 / float32 buffer) or the number of clusters k to draw it for, the
+    seed it is drawn with, when to stop (a step moving H by less than tol, or max_iter steps) and whether the
+    result should come back as nested lists instead of a Matrix */
+    solver = (solver_object*)self;
+    seed = 1234;
+    tol = EPSILON;
+    max_iter = MAX_ITER;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|kdip", keywords, &H_0_lst, &seed, &tol, &max_iter,
+                                     &wants_lists) || max_iter < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    parallel_set_threads(solver->threads);
+
+    /* H is given, or k is */
+    H_0_view.obj = NULL;
+    if (PyLong_Check(H_0_lst)) {
+        k = PyLong_AsLong(H_0_lst);
+        H_0 = NULL;
+        if (k >= 1 && k <= solver->W->rows) {
+            Py_BEGIN_ALLOW_THREADS
+            H_0 = init_H_c(solver->W, (int)k, seed);
+            Py_END_ALLOW_THREADS
+        }
+        if (H_0 == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        }
+    }
+    else {
+        H_0 = build_matrix_from_input(H_0_lst, MATRIX_FLOAT64, &H_0_view);
+    }
+    if (H_0 == NULL) {
+        return NULL;
+    }
+    if (H_0->rows != solver->W->rows) {
+        release_input(H_0, &H_0_view);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    /* Call symnmf_c function without the GIL */
+    Py_BEGIN_ALLOW_THREADS
+    result = symnmf_fit_c(H_0, solver->W, tol, max_iter);
+    Py_END_ALLOW_THREADS
+
+    /* Hand the result to python (as lists if asked for), unless there wasn't enough memory for it */
+    if (result != NULL) {
+        lists = build_output(&result, wants_lists);
+    }
+    else {
+        lists = NULL;
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+
+    /* Free memory */
+    release_input(H_0, &H_0_view);
+    free_matrix(result);
+
+    return lists;
+}
+
+
+static matrix* stack_initial_H(const matrix* W, int k, int restarts, unsigned long seed) {
+    /* restarts random initial H of size n x k side by side (n x (restarts * k)), run s drawn with seed + s. NULL
+    if there isn't enough memory */
+    matrix* block;
+    matrix* H;
+    int i, j, s;
+
+    block = malloc_matrix(W->rows, restarts * k);
+    for (s = 0; s < restarts && block != NULL; s++) {
+        H = init_H_c(W, k, seed + (unsigned long)s);
+        if (H == NULL) {
+            free_matrix(block);
+            return NULL;
+        }
+        for (i = 0; i < H->rows; i++) {
+            for (j = 0; j < k; j++) {
+                MATRIX_AT(block, i, s * k + j) = MATRIX_AT(H, i, j);
+            }
+        }
+        free_matrix(H);
+    }
+
+    return block;
+}
+
+
+static PyObject* solver_fit_restarts(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* Run symnmf_restarts_c on the cached W from H (restarts initial H side by side) or from restarts random H
+    for k clusters, and return the best H with which run it came from and the objectives of all of them */
+    static char* keywords[] = {"H", "restarts", "seed", "tol", "max_iter", "lists", NULL};
+    solver_object* solver;
+    matrix* H_0;
+    matrix* result;
+    Py_buffer H_0_view;
+    PyObject* H_0_lst;
+    PyObject* lists;
+    PyObject* scores;
+    double* objectives;
+    unsigned long seed;
+    double tol;
+    long k;
+    int restarts, max_iter, wants_lists;
+    int best, s;
+
+    /* Get the initial H (2D list or float64 / float32 buffer) or the number of clusters k to draw them for, the
+    number of runs, the seed of the first one, when a run stops (a step moving it by less than tol, or max_iter
+    steps) and whether the result should come back as nested lists instead of a Matrix */
+    solver = (solver_object*)self;
+    seed = 1234;
+    tol = EPSILON;
+    max_iter = MAX_ITER;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|kdip", keywords, &H_0_lst, &restarts, &seed, &tol,
+                                     &max_iter, &wants_lists) || max_iter < 0 || restarts < 1) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    parallel_set_threads(solver->threads);
+
+    /* H is given, or k is */
+    H_0_view.obj = NULL;
+    if (PyLong_Check(H_0_lst)) {
+        k = PyLong_AsLong(H_0_lst);
+        H_0 = NULL;
+        if (k >= 1 && k <= solver->W->rows && k <= INT_MAX / restarts) {
+            Py_BEGIN_ALLOW_THREADS
+            H_0 = stack_initial_H(solver->W, (int)k, restarts, seed);
+            Py_END_ALLOW_THREADS
+        }
+        if (H_0 == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        }
+    }
+    else {
+        H_0 = build_matrix_from_input(H_0_lst, MATRIX_FLOAT64, &H_0_view);
+    }
+    if (H_0 == NULL) {
+        return NULL;
+    }
+    objectives = (double*)malloc((size_t)restarts * sizeof(double));
+    if (H_0->rows != solver->W->rows || H_0->cols % restarts != 0 || objectives == NULL) {
+        release_input(H_0, &H_0_view);
+        free(objectives);
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    /* Call symnmf_restarts_c function without the GIL */
+    Py_BEGIN_ALLOW_THREADS
+    result = symnmf_restarts_c(H_0, solver->W, restarts, tol, max_iter, objectives, &best);
+    Py_END_ALLOW_THREADS
+
+    /* Hand the result to python (as lists if asked for) with the objectives, unless there wasn't enough memory
+    for it */
+    lists = NULL;
+    scores = NULL;
+    if (result != NULL) {
+        lists = build_output(&result, wants_lists);
+        scores = PyList_New(restarts);
+    }
+    else {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+    }
+    for (s = 0; s < restarts && scores != NULL; s++) {
+        PyList_SET_ITEM(scores, s, PyFloat_FromDouble(objectives[s]));
+    }
+    if (lists != NULL && scores != NULL) {
+        lists = Py_BuildValue("(NiN)", lists, best, scores);
+    }
+    else {
+        Py_XDECREF(lists);
+        Py_XDECREF(scores);
+        lists = NULL;
+    }
+
+    /* Free memory */
+    release_input(H_0, &H_0_view);
+    free_matrix(result);
+    free(objectives);
+
+    return lists;
+}
+
+
+static PyObject* solver_norm(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* The cached W, as norm returns it: a dense W is a read-only Matrix over the cache itself */
+    static char* keywords[] = {"lists", NULL};
+    solver_object* solver;
+    matrix* W;
+    int wants_lists;
+
+    solver = (solver_object*)self;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", keywords, &wants_lists)) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+
+    W = solver->W;
+    if (W->layout == MATRIX_CSR) {
+        return build_tuple_from_csr(W);
+    }
+    if (W->layout == MATRIX_LOW_RANK) {
+        return build_tuple_from_low_rank(W);
+    }
+    if (wants_lists || W->layout != MATRIX_DENSE || W->dtype == MATRIX_BFLOAT16) {
+        return build_output(&W, wants_lists);
+    }
+
+    return build_matrix_object(W, self);
+}
+
+
+static PyObject* solver_sym(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* The similarity matrix of the cached X, calculated like W was (dense, packed, sparse or low rank) */
+    static char* keywords[] = {"lists", NULL};
+    solver_object* solver;
+    matrix* result;
+    PyObject* lists;
+    int wants_lists;
+
+    solver = (solver_object*)self;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", keywords, &wants_lists) || solver->X == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    parallel_set_threads(solver->threads);
+
+    /* Call sym_c function without the GIL */
+    Py_BEGIN_ALLOW_THREADS
+    if (solver->knn > 0) {
+        result = sym_knn_c(solver->X, solver->knn);
+    }
+    else if (solver->cutoff > 0) {
+        result = sym_cutoff_c(solver->X, solver->cutoff, NULL);
+    }
+    else if (solver->landmarks > 0) {
+        result = sym_nystrom_c(solver->X, solver->landmarks);
+    }
+    else {
+        result = sym_c(solver->X, solver->packed ? MATRIX_PACKED : MATRIX_DENSE, solver->dtype);
+    }
+    Py_END_ALLOW_THREADS
+
+    /* Hand the result to python, the sparse graph as a (data, indices, indptr) tuple */
+    if (result == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    if (result->layout == MATRIX_CSR) {
+        lists = build_tuple_from_csr(result);
+    }
+    else if (result->layout == MATRIX_LOW_RANK) {
+        lists = build_tuple_from_low_rank(result);
+    }
+    else {
+        lists = build_output(&result, wants_lists);
+    }
+
+    /* Free memory */
+    free_matrix(result);
+
+    return lists;
+}
+
+
+static PyObject* solver_ddg(PyObject *self, PyObject *args, PyObject *kwargs) {
+    /* The diagonal degree matrix of the cached X, calculated the first time and kept */
+    static char* keywords[] = {"lists", NULL};
+    solver_object* solver;
+    matrix* D;
+    int wants_lists;
+
+    solver = (solver_object*)self;
+    wants_lists = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", keywords, &wants_lists) || solver->X == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+        return NULL;
+    }
+    parallel_set_threads(solver->threads);
+
+    /* Call ddg_c function without the GIL. Two threads may both calculate it, the first one to finish keeps it */
+    if (solver->D == NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        if (solver->knn > 0) {
+            D = ddg_knn_c(solver->X, solver->knn);
+        }
+        else if (solver->cutoff > 0) {
+            D = ddg_cutoff_c(solver->X, solver->cutoff, NULL);
+        }
+        else if (solver->landmarks > 0) {
+            D = ddg_nystrom_c(solver->X, solver->landmarks);
+        }
+        else {
+            D = ddg_c(solver->X);
+        }
+        Py_END_ALLOW_THREADS
+
+        if (D == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "An Error Has Occurred");
+            return NULL;
+        }
+        if (solver->D == NULL) {
+            solver->D = D;
+        }
+        else {
+            free_matrix(D);
+        }
+    }
+
+    /* The diagonal is expanded into a copy, the cached one stays */
+    D = solver->D;
+    return build_output(&D, wants_lists);
+}
+
+
+static PyMethodDef solver_methods[] = {
+    {"fit",
+        (PyCFunction)(void(*)(void))solver_fit,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("fit(H or k, seed=1234, tol=1e-4, max_iter=300, lists=False): run symnmf on the cached W")},
+    {"fit_restarts",
+        (PyCFunction)(void(*)(void))solver_fit_restarts,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("fit_restarts(H or k, restarts, seed=1234, tol=1e-4, max_iter=300, lists=False): run symnmf "
+                  "from several initial H in one batch, returns (best H, its run, objectives of all runs)")},
+    {"norm",
+        (PyCFunction)(void(*)(void))solver_norm,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("norm(lists=False): the cached normalized similarity matrix")},
+    {"sym",
+        (PyCFunction)(void(*)(void))solver_sym,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("sym(lists=False): the similarity matrix of the cached X")},
+    {"ddg",
+        (PyCFunction)(void(*)(void))solver_ddg,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("ddg(lists=False): the diagonal degree matrix of the cached X")},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyType_Slot solver_slots[] = {
+    {Py_tp_new, (void*)solver_new},
+    {Py_tp_dealloc, (void*)solver_dealloc},
+    {Py_tp_methods, (void*)solver_methods},
+    {Py_tp_doc, (void*)PyDoc_STR("Solver(X=None, W=None, packed=False, threads=0, knn=0, cutoff=0, landmarks=0, "
+                                 "precision='double'): W kept on the C side for repeated symnmf runs")},
+    {0, NULL}
+};
+
+
+static PyType_Spec solver_spec = {
+    "symnmf_module.Solver",
+    sizeof(solver_object),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    solver_slots
+};
+
+
 static PyMethodDef symnmfMethods[] = {
     {"sym",
-        (PyCFunction)sym,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))sym,
+        METH_VARARGS | METH_KEYWORDS,
         PyDoc_STR("C module function to call sym_c")},
     {"ddg",
-        (PyCFunction)ddg,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))ddg,
+        METH_VARARGS | METH_KEYWORDS,
         PyDoc_STR("C module function to call ddg_c")},
     {"norm",
-        (PyCFunction)norm,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))norm,
+        METH_VARARGS | METH_KEYWORDS,
         PyDoc_STR("C module function to call norm_c")},
     {"symnmf",
-        (PyCFunction)symnmf,
-        METH_VARARGS,
+        (PyCFunction)(void(*)(void))symnmf,
+        METH_VARARGS | METH_KEYWORDS,
         PyDoc_STR("C module function to call symnmf_c")},
+    {"format",
+        (PyCFunction)(void(*)(void))format,
+        METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("C module function to call format_matrix or write_matrix")},
     {NULL, NULL, 0, NULL}
 };
 
@@ -235,5 +1671,33 @@ PyMODINIT_FUNC PyInit_symnmf_module(void) {
     if (!m) {
         return NULL;
     }
+
+    /* Pick the vector kernels while the GIL is held, the calls that release it only read the choice */
+    simd_select();
+
+    /* The type of the matrices the module returns */
+    if (matrix_type == NULL && (matrix_type = (PyTypeObject*)PyType_FromSpec(&matrix_spec)) == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(matrix_type);
+    if (PyModule_AddObject(m, "Matrix", (PyObject*)matrix_type) != 0) {
+        Py_DECREF(matrix_type);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    /* The type of the solvers that keep W between runs */
+    if (solver_type == NULL && (solver_type = (PyTypeObject*)PyType_FromSpec(&solver_spec)) == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(solver_type);
+    if (PyModule_AddObject(m, "Solver", (PyObject*)solver_type) != 0) {
+        Py_DECREF(solver_type);
+        Py_DECREF(m);
+        return NULL;
+    }
+
     return m;
 }
\ No newline at end of file